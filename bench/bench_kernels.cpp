@@ -0,0 +1,66 @@
+#include <gtfs_simd.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <time.h>
+
+using namespace std;
+
+// Throughput of the checksum and compare kernels at every ISA level the CPU supports.
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    size_t size = 1 << 20;
+    int rounds = 2000;
+    if (argc > 1) {
+        size = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        rounds = (int)strtol(argv[2], NULL, 10);
+    }
+
+    vector<char> a(size), b(size);
+    for (size_t i = 0; i < size; i++) {
+        a[i] = (char)rand();
+    }
+    memcpy(b.data(), a.data(), size);
+
+    uint32_t check = gtfs_crc32c(0, "123456789", 9);
+    printf("crc32c(\"123456789\") = %08x %s\n", check, check == 0xE3069283 ? "ok" : "WRONG");
+    printf("buffer %zu bytes, %d rounds\n\n", size, rounds);
+    printf("%-8s %12s %12s\n", "level", "crc32c GB/s", "equal GB/s");
+
+    int best = gtfs_simd_detect();
+    uint32_t ref = 0;
+    for (int level = GTFS_SIMD_SCALAR; level <= best; level++) {
+        gtfs_simd_set_level(level);
+
+        uint32_t crc = 0;
+        double t0 = now_sec();
+        for (int r = 0; r < rounds; r++) {
+            crc = gtfs_crc32c(crc, a.data(), size);
+        }
+        double t_crc = now_sec() - t0;
+        if (level == GTFS_SIMD_SCALAR) {
+            ref = crc;
+        }
+
+        size_t same = 0;
+        t0 = now_sec();
+        for (int r = 0; r < rounds; r++) {
+            same += gtfs_range_equal(a.data(), b.data(), size);
+        }
+        double t_eq = now_sec() - t0;
+
+        double gb = (double)size * rounds / 1e9;
+        printf("%-8s %12.2f %12.2f%s\n", gtfs_simd_level_name(level), gb / t_crc, gb / t_eq,
+               (crc != ref || same != (size_t)rounds) ? "  MISMATCH" : "");
+    }
+    return 0;
+}
@@ -7,7 +7,13 @@
 #include <iostream>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <stdint.h>
 #include <map>
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+#include "gtfs_readahead.hpp"
 
 using namespace std;
 
@@ -19,6 +25,26 @@ using namespace std;
 #define MAX_FILENAME_LEN 255
 #define MAX_NUM_FILES_PER_DIR 1024
 
+// gtfs_open_file flags
+#define GTFS_OPEN_COMPRESS 0x1   // LZ-compress log payloads against a per-file dictionary
+#define GTFS_OPEN_READONLY 0x2   // writes are refused; set for files opened from a snapshot
+#define GTFS_OPEN_POOLED 0x4     // no mapping; pages are read on demand into the buffer pool
+#define GTFS_OPEN_APPEND 0x8     // writes past the append mark keep no before-image
+#define GTFS_OPEN_MVCC 0x10      // pending writes stay out of the mapping; reads see the last commit
+#define GTFS_OPEN_COMBINE 0x20   // synced writes are merged in a buffer and logged together
+
+// GTFileSystem init flags
+#define GTFS_INIT_DIRECT_LOG 0x1 // write the log with O_DIRECT, bypassing the page cache
+#define GTFS_INIT_DEDUP 0x2      // checkpoints move closed files into a deduplicating block store
+
+// Snapshots live in <dirname>/GTFS_SNAPSHOT_DIR/<name>
+#define GTFS_SNAPSHOT_DIR ".snapshots"
+
+// Replication acknowledgement modes
+#define GTFS_REPL_ASYNC 0   // sync returns once the record is shipped
+#define GTFS_REPL_SYNC  1   // sync returns once the follower acknowledged it
+#define GTFS_REPL_TIMEOUT_MS 5000
+
 extern int do_verbose;
 
 typedef struct gtfs {
@@ -26,44 +52,155 @@ typedef struct gtfs {
     // TODO: Add any additional fields if necessary
 
     map <string, void*>* file_add_dict;
+    std::mutex* files_lock;   // file_add_dict
     static gtfs* gtfs_metadata;
+    struct repl* repl;
+    struct wal* wal;
+    int flags;
+    struct catalog* catalog;
+    struct pool* pool;     // created by the first GTFS_OPEN_POOLED open
+    size_t pool_size;      // bytes, 0 for GTFS_POOL_DEFAULT_SIZE
+    struct combine_set* combining;   // open GTFS_OPEN_COMBINE files
+    struct quota* quota;   // log budget, NULL until one is set
 
 } gtfs_t;
 
 typedef struct file {
     std::string filename;
-    int file_length;
+    off_t file_length;
     // TODO: Add any additional fields if necessary
 
-    void* addr;
+    void* addr;            // first window, if the file fits in one
+    // What a close takes off the file is atomic: readers load it once per
+    // epoch section, and it is freed only after that section ends.
+    std::atomic<struct window_map*> map;   // NULL for GTFS_OPEN_POOLED and once closed
+    std::string path;
+    int flags;
+    std::string dict;
+    std::vector<struct write*> pending;
+    std::mutex pending_lock;   // writes may be staged and committed on different threads
+    struct gtfs* gtfs;
+    std::atomic<int> fd;   // base file, kept open for window mappings and pool reads; -1 once closed
+    readahead_t ra;        // access pattern of gtfs_read_file
+    off_t append_mark;     // GTFS_OPEN_APPEND: everything past it is zero
+    std::atomic<struct mvcc*> mvcc;   // GTFS_OPEN_MVCC: committed versions kept for readers
+    struct combine* combine;   // GTFS_OPEN_COMBINE: synced writes not logged yet
+    uint64_t mapped_lsn;   // the mapping started out with the file's records up to here
+    uint64_t writer;       // tags this handle's records in the catalog
+    pid_t writer_pid;      // writer was made by this process; a forked child makes its own
+    std::atomic<int> refs; // the opener's hold plus one per unreleased write_t
 } file_t;
 
 typedef struct write {
     std::string filename;
-    int offset;
-    int length;
+    off_t offset;
+    size_t length;
     char *data;
     // TODO: Add any additional fields if necessary
 
     char *org_data;
     void* addr;
+    file_t* fl;
+    bool org_committed;   // before-image holds no other pending write's bytes
+    bool appended;        // staged past the append mark; org_data is all zeros
+    // gtfs_writev: offset and length span all extents, data and org_data
+    // hold the extents' bytes back to back in offset order.
+    std::vector<std::pair<off_t, size_t> > extents;
 } write_t;
 
+// Log backlog, and what the log budget cost this process's commits.
+typedef struct gtfs_log_stats {
+    uint64_t backlog;        // bytes logged since the last checkpoint
+    uint64_t file_backlog;   // the most of them for one file
+    uint64_t stalls;         // commits delayed by the budget
+    uint64_t stall_ns;       // time they were delayed, in total
+    uint64_t max_stall_ns;
+    uint64_t checkpoints;    // checkpoints the budget started
+} gtfs_log_stats_t;
+
+// One extent of a vectored read or write.
+typedef struct gtfs_iovec {
+    off_t offset;
+    size_t length;
+    void* base;
+} gtfs_iovec_t;
+
 // GTFileSystem basic API calls
 
-gtfs_t* gtfs_init(std::string directory, int verbose_flag);
+gtfs_t* gtfs_init(std::string directory, int verbose_flag, int flags = 0);
 int gtfs_clean(gtfs_t *gtfs);
 
-file_t* gtfs_open_file(gtfs_t* gtfs, std::string filename, int file_length);
+file_t* gtfs_open_file(gtfs_t* gtfs, std::string filename, off_t file_length, int flags = 0);
 int gtfs_close_file(gtfs_t* gtfs, file_t* fl);
 int gtfs_remove_file(gtfs_t* gtfs, file_t* fl);
 
-char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length);
-write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const char* data);
+char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length);
+write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length, const char* data);
 int gtfs_sync_write_file(write_t* write_id);
+int gtfs_sync_write_files(std::vector<write_t*> write_ids);
 int gtfs_abort_write_file(write_t* write_id);
+// Logs the synced writes a GTFS_OPEN_COMBINE file still buffers. Syncing a
+// write to such a file returns before it is logged; it becomes durable up to
+// GTFS_COMBINE_DELAY_MS later, or here.
+int gtfs_flush_file(gtfs_t* gtfs, file_t* fl);
+
+// Vectored I/O on one file. A vectored write is a single write_t whose
+// extents must not overlap; it syncs or aborts as a whole.
+int gtfs_readv(gtfs_t* gtfs, file_t* fl, const gtfs_iovec_t* iov, int iovcnt);
+write_t* gtfs_writev(gtfs_t* gtfs, file_t* fl, const gtfs_iovec_t* iov, int iovcnt);
+
+// Ownership. A file_t is held by its opener and by every write_t on it, and
+// is freed when the last hold goes. gtfs_release_write frees a write, aborting
+// it if still pending; gtfs_release_file drops the opener's hold, closing the
+// file first if needed. A closed file's mapping is unmapped only once no
+// concurrent read or write can still be using it.
+int gtfs_release_write(write_t* write_id);
+int gtfs_release_file(gtfs_t* gtfs, file_t* fl);
+
+// Files of the directory, from its catalog.
+std::vector<std::string> gtfs_list_files(gtfs_t* gtfs);
+
+// Sets the memory budget of the buffer pool; only before the first pooled open.
+int gtfs_set_pool_size(gtfs_t* gtfs, size_t bytes);
+
+// Bounds the bytes the log holds for all files and for any one file, 0 for
+// no bound. Commits nearing a bound checkpoint the log or are paced; they are
+// never refused for it.
+int gtfs_set_log_budget(gtfs_t* gtfs, size_t total, size_t per_file);
+int gtfs_get_log_stats(gtfs_t* gtfs, gtfs_log_stats_t* stats);
 
 int gtfs_clean_n_bytes(gtfs_t *gtfs, int bytes);
 int gtfs_sync_write_file_n_bytes(write_t* write_id, int bytes);
 
+// GTFileSystem snapshots
+
+int gtfs_snapshot_create(gtfs_t* gtfs, std::string name);
+int gtfs_snapshot_delete(gtfs_t* gtfs, std::string name);
+file_t* gtfs_open_snapshot_file(gtfs_t* gtfs, std::string name, std::string filename);
+
+// GTFileSystem cluster: files are spread over several directories (one per
+// device) by consistent hashing of the file name. Each shard is a complete
+// GTFileSystem with its own logs.
+
+#define GTFS_CLUSTER_VNODES 64   // ring positions per directory
+
+typedef struct gtfs_cluster {
+    std::vector<gtfs_t*> shards;
+    std::map<unsigned int, int> ring;   // ring position -> index into shards
+} gtfs_cluster_t;
+
+gtfs_cluster_t* gtfs_cluster_init(std::vector<std::string> directories, int verbose_flag, int flags = 0);
+int gtfs_cluster_clean(gtfs_cluster_t* cluster);
+int gtfs_cluster_add_root(gtfs_cluster_t* cluster, std::string directory);
+gtfs_t* gtfs_cluster_shard(gtfs_cluster_t* cluster, std::string filename);
+file_t* gtfs_cluster_open_file(gtfs_cluster_t* cluster, std::string filename, off_t file_length, int flags = 0);
+int gtfs_cluster_close_file(gtfs_cluster_t* cluster, file_t* fl);
+
+// GTFileSystem replication (log shipping over a connected socket or pipe pair)
+
+int gtfs_repl_attach(gtfs_t* gtfs, int fd, int mode);
+int gtfs_repl_detach(gtfs_t* gtfs);
+int gtfs_repl_flush(gtfs_t* gtfs);
+int gtfs_repl_follow(gtfs_t* gtfs, int fd);
+
 #endif
@@ -0,0 +1,449 @@
+#include "gtfs_blocks.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_io.hpp"
+#include "gtfs_simd.hpp"
+#include "gtfs_wal.hpp"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <map>
+#include <set>
+#include <sstream>
+
+using namespace std;
+
+static const char blocks_zeros[GTFS_BLOCK_SIZE] = {0};
+static const char* blocks_hole = "-";
+static std::atomic<size_t> blocks_written(0);
+
+static string blocks_dir(const string& dir) {
+    return dir + "/" GTFS_BLOCKS_NAME;
+}
+
+static string blocks_map_path(const string& dir, const string& filename) {
+    return blocks_dir(dir) + "/" GTFS_BLOCKS_MAPS "/" + filename;
+}
+
+static void blocks_sync_dir(const string& dir) {
+    int fd = gtfs_io()->open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (fd >= 0) {
+        gtfs_io()->fsync(fd);
+        gtfs_io()->close(fd);
+    }
+}
+
+static bool blocks_base_name(const string& fname) {
+    return fname[0] != '.' && fname.size() <= MAX_FILENAME_LEN && fname.find(".tmp") == string::npos &&
+           !(fname.size() > 5 && fname.compare(fname.size() - 5, 5, ".dict") == 0);
+}
+
+static int blocks_read_full(int fd, char* buf, size_t len, off_t pos) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = gtfs_io()->pread(fd, buf + done, len - done, pos + (off_t)done);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static int blocks_write_full(int fd, const char* buf, size_t len, off_t pos) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = gtfs_io()->pwrite(fd, buf + done, len - done, pos + (off_t)done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+// CRC32C and FNV-1a side by side; a name match is still checked byte for byte.
+static string blocks_hash(const char* data, size_t len) {
+    uint64_t fnv = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        fnv = (fnv ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%08x%016llx", gtfs_crc32c(0, data, len), (unsigned long long)fnv);
+    return name;
+}
+
+typedef struct chunk_map {
+    off_t size;                 // of the base file
+    vector<string> chunks;      // blocks_hole for all-zero chunks
+} chunk_map_t;
+
+static int blocks_load_map(const string& path, chunk_map_t& cm) {
+    string text;
+    if (gtfs_io_read_file(path, text) != 0) {
+        return -1;
+    }
+    istringstream in(text);
+    string magic, name;
+    long long size = 0;
+    unsigned block = 0;
+    int ret = -1;
+    if ((in >> magic >> size >> block) &&
+        magic == GTFS_BLOCKS_MAP_MAGIC && block == GTFS_BLOCK_SIZE && size >= 0) {
+        cm.size = (off_t)size;
+        cm.chunks.clear();
+        while (in >> name) {
+            cm.chunks.push_back(name);
+        }
+        if (cm.chunks.size() == ((size_t)size + GTFS_BLOCK_SIZE - 1) / GTFS_BLOCK_SIZE) {
+            ret = 0;
+        }
+    }
+    if (ret != 0) {
+        ERROR_PRINT("bad chunk map " << path << "\n");
+    }
+    return ret;
+}
+
+static int blocks_save_map(const string& path, const chunk_map_t& cm) {
+    std::stringstream out;
+    out << GTFS_BLOCKS_MAP_MAGIC << " " << (long long)cm.size << " " << GTFS_BLOCK_SIZE << "\n";
+    for (size_t i = 0; i < cm.chunks.size(); i++) {
+        out << cm.chunks[i] << "\n";
+    }
+    string buf = out.str();
+    string tmp = path + ".tmp";
+    int fd = gtfs_io()->open(tmp.c_str(), O_CREAT|O_TRUNC|O_WRONLY, S_IRWXU);
+    if (fd < 0) {
+        return -1;
+    }
+    if (blocks_write_full(fd, buf.data(), buf.size(), 0) != 0 || gtfs_io()->fdatasync(fd) != 0) {
+        gtfs_io()->close(fd);
+        gtfs_io()->unlink(tmp.c_str());
+        return -1;
+    }
+    gtfs_io()->close(fd);
+    return gtfs_io()->rename(tmp.c_str(), path.c_str());
+}
+
+// Writes dehydrated filename's content to dst through a temporary file.
+static int blocks_materialize(const string& dir, const string& filename, const string& dst) {
+    chunk_map_t cm;
+    if (blocks_load_map(blocks_map_path(dir, filename), cm) != 0) {
+        return -1;
+    }
+    string tmp = dst + ".tmp." + to_string(getpid());
+    int fd = gtfs_io()->open(tmp.c_str(), O_CREAT|O_TRUNC|O_WRONLY, S_IRWXU);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = gtfs_io()->ftruncate(fd, cm.size);
+    char* buf = new char[GTFS_BLOCK_SIZE];
+    for (size_t i = 0; ret == 0 && i < cm.chunks.size(); i++) {
+        if (cm.chunks[i] == blocks_hole) {
+            continue;
+        }
+        off_t pos = (off_t)i * GTFS_BLOCK_SIZE;
+        size_t len = cm.size - pos < GTFS_BLOCK_SIZE ? (size_t)(cm.size - pos) : GTFS_BLOCK_SIZE;
+        int cfd = gtfs_io()->open((blocks_dir(dir) + "/" + cm.chunks[i]).c_str(), O_RDONLY);
+        if (cfd < 0 || blocks_read_full(cfd, buf, len, 0) != 0 || blocks_write_full(fd, buf, len, pos) != 0) {
+            ERROR_PRINT("cannot restore chunk " << cm.chunks[i] << " of " << filename << "\n");
+            ret = -1;
+        }
+        if (cfd >= 0) {
+            gtfs_io()->close(cfd);
+        }
+    }
+    delete[] buf;
+    if (ret == 0 && gtfs_io()->fdatasync(fd) != 0) {
+        ret = -1;
+    }
+    gtfs_io()->close(fd);
+    if (ret == 0) {
+        ret = gtfs_io()->rename(tmp.c_str(), dst.c_str());
+    }
+    if (ret != 0) {
+        gtfs_io()->unlink(tmp.c_str());
+    }
+    DEBUG_PRINT(do_verbose, "restored " << filename << " from " << cm.chunks.size() << " chunks\n");
+    return ret;
+}
+
+// Name of the stored chunk holding data, storing it if no chunk does. A
+// different chunk under the same hash gets the next free suffix.
+static int blocks_put_chunk(const string& store, const char* data, size_t len, char* cmp, string& name) {
+    string hash = blocks_hash(data, len);
+    for (int n = 0; ; n++) {
+        name = n == 0 ? hash : hash + "-" + to_string(n);
+        string path = store + "/" + name;
+        int fd = gtfs_io()->open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            struct stat s;
+            bool same = gtfs_io()->fstat(fd, &s) == 0 && (size_t)s.st_size == len &&
+                        blocks_read_full(fd, cmp, len, 0) == 0 && memcmp(cmp, data, len) == 0;
+            gtfs_io()->close(fd);
+            if (same) {
+                return 0;
+            }
+            continue;
+        }
+        string tmp = path + ".tmp";
+        fd = gtfs_io()->open(tmp.c_str(), O_CREAT|O_TRUNC|O_WRONLY, S_IRWXU);
+        if (fd < 0) {
+            return -1;
+        }
+        if (blocks_write_full(fd, data, len, 0) != 0 || gtfs_io()->fdatasync(fd) != 0) {
+            gtfs_io()->close(fd);
+            gtfs_io()->unlink(tmp.c_str());
+            return -1;
+        }
+        gtfs_io()->close(fd);
+        blocks_written += len;
+        return gtfs_io()->rename(tmp.c_str(), path.c_str());
+    }
+}
+
+// Replaces an unopened base file by its chunk map. Returns 1 if the file is
+// open somewhere and was left alone.
+static int blocks_dehydrate(const string& dir, const string& filename) {
+    string path = dir + "/" + filename;
+    string store = blocks_dir(dir);
+    int fd = gtfs_io()->open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (gtfs_io()->flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        gtfs_io()->close(fd);
+        return 1;
+    }
+    struct stat s;
+    if (gtfs_io()->fstat(fd, &s) != 0) {
+        gtfs_io()->close(fd);
+        return -1;
+    }
+    chunk_map_t cm;
+    cm.size = s.st_size;
+    char* buf = new char[GTFS_BLOCK_SIZE];
+    char* cmp = new char[GTFS_BLOCK_SIZE];
+    int ret = 0;
+    size_t fresh = blocks_written;
+    for (off_t pos = 0; ret == 0 && pos < cm.size; pos += GTFS_BLOCK_SIZE) {
+        size_t len = cm.size - pos < GTFS_BLOCK_SIZE ? (size_t)(cm.size - pos) : GTFS_BLOCK_SIZE;
+        string name;
+        if (blocks_read_full(fd, buf, len, pos) != 0) {
+            ret = -1;
+        } else if (memcmp(buf, blocks_zeros, len) == 0) {
+            cm.chunks.push_back(blocks_hole);
+        } else if ((ret = blocks_put_chunk(store, buf, len, cmp, name)) == 0) {
+            cm.chunks.push_back(name);
+        }
+    }
+    delete[] buf;
+    delete[] cmp;
+
+    // The chunks are durable before the map naming them, and the map before
+    // the base file goes.
+    if (ret == 0) {
+        if (blocks_written != fresh) {
+            blocks_sync_dir(store);
+        }
+        ret = blocks_save_map(blocks_map_path(dir, filename), cm);
+    }
+    if (ret == 0) {
+        blocks_sync_dir(store + "/" GTFS_BLOCKS_MAPS);
+        ret = gtfs_io()->unlink(path.c_str());
+        DEBUG_PRINT(do_verbose, "dehydrated " << filename << ", " << blocks_written - fresh << " new chunk bytes\n");
+    }
+    gtfs_io()->close(fd);
+    return ret;
+}
+
+// Takes the log directory's flock for operations that must not overlap a
+// checkpoint; -1 if the directory has no log yet.
+static int blocks_lock(gtfs_t* gtfs, int how) {
+    int dfd = gtfs_io()->open(gtfs_wal_dir(gtfs).c_str(), O_RDONLY|O_DIRECTORY);
+    if (dfd >= 0) {
+        gtfs_io()->flock(dfd, how);
+    }
+    return dfd;
+}
+
+static void blocks_unlock(int dfd) {
+    if (dfd >= 0) {
+        gtfs_io()->close(dfd);
+    }
+}
+
+bool gtfs_blocks_init(gtfs_t* gtfs, bool create) {
+    string store = blocks_dir(gtfs->dirname);
+    if (create) {
+        gtfs_io()->mkdir(store.c_str(), S_IRWXU);
+        gtfs_io()->mkdir((store + "/" GTFS_BLOCKS_MAPS).c_str(), S_IRWXU);
+        // Opens and checkpoints serialize on the log's lock, so it must exist.
+        gtfs_io()->mkdir(gtfs_wal_dir(gtfs).c_str(), S_IRWXU);
+        blocks_sync_dir(gtfs->dirname);
+    }
+    struct stat s;
+    return gtfs_io()->stat((store + "/" GTFS_BLOCKS_MAPS).c_str(), &s) == 0 && S_ISDIR(s.st_mode);
+}
+
+int gtfs_blocks_open(gtfs_t* gtfs, const string& filename) {
+    string path = gtfs->dirname + "/" + filename;
+    string map = blocks_map_path(gtfs->dirname, filename);
+    int dfd = blocks_lock(gtfs, LOCK_SH);
+    if (gtfs_io()->access(path.c_str(), F_OK) != 0 && gtfs_io()->access(map.c_str(), F_OK) == 0) {
+        // Converting the flock may let another opener in first.
+        if (dfd >= 0) {
+            gtfs_io()->flock(dfd, LOCK_EX);
+        }
+        if (gtfs_io()->access(path.c_str(), F_OK) != 0 && blocks_materialize(gtfs->dirname, filename, path) != 0) {
+            ERROR_PRINT("cannot restore " << filename << " from the block store\n");
+            blocks_unlock(dfd);
+            return -1;
+        }
+        blocks_sync_dir(gtfs->dirname);
+    }
+    int fd = gtfs_io()->open(path.c_str(), O_CREAT|O_RDWR, S_IRWXU);
+    if (fd >= 0) {
+        gtfs_io()->flock(fd, LOCK_SH);
+    }
+    blocks_unlock(dfd);
+    return fd;
+}
+
+int gtfs_blocks_restore(gtfs_t* gtfs, const string& filename) {
+    string path = gtfs->dirname + "/" + filename;
+    string map = blocks_map_path(gtfs->dirname, filename);
+    if (gtfs_io()->access(map.c_str(), F_OK) != 0) {
+        return 0;
+    }
+    int dfd = blocks_lock(gtfs, LOCK_EX);
+    int ret = 0;
+    if (gtfs_io()->access(path.c_str(), F_OK) != 0) {
+        ret = blocks_materialize(gtfs->dirname, filename, path);
+        blocks_sync_dir(gtfs->dirname);
+    }
+    if (ret == 0) {
+        gtfs_io()->unlink(map.c_str());
+    }
+    blocks_unlock(dfd);
+    return ret;
+}
+
+int gtfs_blocks_export(gtfs_t* gtfs, const string& filename, const string& dst) {
+    int dfd = blocks_lock(gtfs, LOCK_SH);
+    int ret = blocks_materialize(gtfs->dirname, filename, dst);
+    blocks_unlock(dfd);
+    return ret;
+}
+
+void gtfs_blocks_forget(gtfs_t* gtfs, const string& filename) {
+    gtfs_io()->unlink(blocks_map_path(gtfs->dirname, filename).c_str());
+}
+
+vector<pair<string, off_t> > gtfs_blocks_list(const string& dir) {
+    vector<pair<string, off_t> > files;
+    string maps = blocks_dir(dir) + "/" GTFS_BLOCKS_MAPS;
+    vector<string> names;
+    if (gtfs_io()->list(maps.c_str(), &names) != 0) {
+        return files;
+    }
+    for (size_t i = 0; i < names.size(); i++) {
+        const string& fname = names[i];
+        chunk_map_t cm;
+        if (blocks_base_name(fname) && blocks_load_map(maps + "/" + fname, cm) == 0) {
+            files.push_back(make_pair(fname, cm.size));
+        }
+    }
+    return files;
+}
+
+int gtfs_blocks_checkpoint(gtfs_t* gtfs) {
+    const string& dir = gtfs->dirname;
+    string store = blocks_dir(dir);
+    vector<string> listed, names;
+    if (gtfs_io()->list(dir.c_str(), &listed) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < listed.size(); i++) {
+        const string& fname = listed[i];
+        struct stat s;
+        if (blocks_base_name(fname) && gtfs_io()->stat((dir + "/" + fname).c_str(), &s) == 0 && S_ISREG(s.st_mode)) {
+            names.push_back(fname);
+        }
+    }
+
+    int ret = 0;
+    size_t busy = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        int r = blocks_dehydrate(dir, names[i]);
+        if (r < 0) {
+            ERROR_PRINT("cannot dehydrate " << names[i] << "\n");
+            ret = -1;
+        } else if (r > 0) {
+            busy++;
+        }
+    }
+
+    // Reference counts come from the maps; chunks no map names are garbage.
+    map<string, size_t> refs;
+    vector<pair<string, off_t> > maps = gtfs_blocks_list(dir);
+    for (size_t i = 0; i < maps.size(); i++) {
+        chunk_map_t cm;
+        if (blocks_load_map(blocks_map_path(dir, maps[i].first), cm) == 0) {
+            for (size_t j = 0; j < cm.chunks.size(); j++) {
+                refs[cm.chunks[j]]++;
+            }
+        }
+    }
+    size_t dropped = 0;
+    vector<string> chunks;
+    if (gtfs_io()->list(store.c_str(), &chunks) == 0) {
+        for (size_t i = 0; i < chunks.size(); i++) {
+            const string& fname = chunks[i];
+            if (fname[0] != '.' && fname != GTFS_BLOCKS_MAPS && refs.find(fname) == refs.end() &&
+                gtfs_io()->unlink((store + "/" + fname).c_str()) == 0) {
+                dropped++;
+            }
+        }
+    }
+    if (dropped > 0) {
+        blocks_sync_dir(store);
+    }
+    DEBUG_PRINT(do_verbose, names.size() - busy << " files dehydrated, " << busy << " open, " << refs.size()
+                << " chunks referenced, " << dropped << " dropped\n");
+    return ret;
+}
+
+int gtfs_blocks_stat(gtfs_t* gtfs, blocks_stat_t* st) {
+    string store = blocks_dir(gtfs->dirname);
+    vector<string> names;
+    if (gtfs_io()->list(store.c_str(), &names) != 0) {
+        return -1;
+    }
+    memset(st, 0, sizeof(*st));
+    for (size_t i = 0; i < names.size(); i++) {
+        const string& fname = names[i];
+        struct stat s;
+        if (fname[0] != '.' && fname.find(".tmp") == string::npos &&
+            gtfs_io()->stat((store + "/" + fname).c_str(), &s) == 0 && S_ISREG(s.st_mode)) {
+            st->chunks++;
+            st->bytes += (size_t)s.st_size;
+        }
+    }
+    st->maps = gtfs_blocks_list(gtfs->dirname).size();
+    st->written = blocks_written;
+    return 0;
+}
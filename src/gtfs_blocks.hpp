@@ -0,0 +1,61 @@
+#ifndef GTFS_BLOCKS
+#define GTFS_BLOCKS
+
+#include "gtfs.hpp"
+
+#include <sys/types.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Content-addressed block store of a GTFileSystem directory, enabled with
+// GTFS_INIT_DEDUP. Once enabled for a directory (<dir>/.blocks exists) every
+// process using it works in dedup mode.
+//
+// A checkpoint cuts each base file no process has open into fixed-size
+// chunks named by their hash, writes the chunks the store does not have yet
+// and replaces the base file with a chunk map in <dir>/.blocks/maps. All-zero
+// chunks are holes and take no space. Opening the file rebuilds the base file
+// from its map, so reads, writes and the log keep working on base files.
+//
+// Whenever a base file exists it is the file's content and its map, if any,
+// is stale. Open files hold a shared flock on their base file; dehydration
+// needs it exclusively, and it happens under the exclusive log lock that
+// opening a dehydrated file also takes. Chunk references are counted from the
+// maps at each checkpoint and unreferenced chunks are deleted then, so
+// nothing has to be kept consistent across a crash.
+
+#define GTFS_BLOCKS_NAME ".blocks"
+#define GTFS_BLOCKS_MAPS "maps"
+#define GTFS_BLOCK_SIZE 65536
+#define GTFS_BLOCKS_MAP_MAGIC "GTFS-MAP"
+
+typedef struct blocks_stat {
+    size_t chunks;          // chunk files in the store
+    size_t bytes;           // their total size
+    size_t maps;            // dehydrated files
+    size_t written;         // chunk bytes written by this process's checkpoints
+} blocks_stat_t;
+
+// Sets up the store when asked to, and reports whether the directory has one.
+bool gtfs_blocks_init(gtfs_t* gtfs, bool create);
+
+// Opens filename's base file for gtfs_open_file, rebuilding it from its map
+// first if it was dehydrated, and takes the shared flock on it.
+int gtfs_blocks_open(gtfs_t* gtfs, const std::string& filename);
+// Rebuilds the base file if the file is dehydrated and drops its map.
+int gtfs_blocks_restore(gtfs_t* gtfs, const std::string& filename);
+// Writes the content of a dehydrated file to dst.
+int gtfs_blocks_export(gtfs_t* gtfs, const std::string& filename, const std::string& dst);
+void gtfs_blocks_forget(gtfs_t* gtfs, const std::string& filename);
+
+// Dehydrated files of dir with the size of their base files.
+std::vector<std::pair<std::string, off_t> > gtfs_blocks_list(const std::string& dir);
+
+// Called by the checkpoint under the exclusive log lock, after every record
+// is in a base file.
+int gtfs_blocks_checkpoint(gtfs_t* gtfs);
+
+int gtfs_blocks_stat(gtfs_t* gtfs, blocks_stat_t* st);
+
+#endif
@@ -0,0 +1,422 @@
+#include "gtfs_catalog.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_io.hpp"
+#include "gtfs_simd.hpp"
+#include "gtfs_wal.hpp"
+#include "gtfs_blocks.hpp"
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+static const size_t catalog_none = (size_t)-1;
+
+static uint32_t catalog_super_crc(const catalog_super_t* super) {
+    return gtfs_crc32c(0, super, offsetof(catalog_super_t, crc));
+}
+
+static bool catalog_valid(const catalog_t* cat) {
+    const catalog_super_t* super = cat->super;
+    if (super->magic != GTFS_CATALOG_MAGIC || super->version != GTFS_CATALOG_VERSION ||
+        super->capacity != MAX_NUM_FILES_PER_DIR || super->crc != catalog_super_crc(super)) {
+        return false;
+    }
+    for (size_t i = 0; i < super->capacity; i++) {
+        const catalog_entry_t& e = cat->entries[i];
+        if ((e.flags & GTFS_CATALOG_IN_USE) && memchr(e.name, '\0', sizeof(e.name)) == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Re-takes the fd after a fork: a flock on the inherited one would be
+// shared with the parent.
+static int catalog_fd(catalog_t* cat) {
+    if (cat->pid != getpid()) {
+        gtfs_io()->close(cat->fd);
+        cat->fd = gtfs_io()->open(cat->path.c_str(), O_RDWR);
+        cat->pid = getpid();
+    }
+    return cat->fd;
+}
+
+static int catalog_sync(catalog_t* cat) {
+    return gtfs_io()->msync(cat->addr, cat->size, MS_SYNC);
+}
+
+static size_t catalog_find(catalog_t* cat, const string& filename) {
+    map<string, size_t>::iterator it = cat->slots.find(filename);
+    if (it != cat->slots.end()) {
+        const catalog_entry_t& e = cat->entries[it->second];
+        if ((e.flags & GTFS_CATALOG_IN_USE) && filename == e.name) {
+            return it->second;
+        }
+        cat->slots.erase(it);
+    }
+    // Another process may have added or moved it.
+    for (size_t i = 0; i < cat->super->capacity; i++) {
+        const catalog_entry_t& e = cat->entries[i];
+        if ((e.flags & GTFS_CATALOG_IN_USE) && filename == e.name) {
+            cat->slots[filename] = i;
+            return i;
+        }
+    }
+    return catalog_none;
+}
+
+// Slot of filename, claimed if it has none. Caller holds the catalog flock.
+static size_t catalog_claim(catalog_t* cat, const string& filename, off_t length) {
+    size_t slot = catalog_find(cat, filename);
+    if (slot != catalog_none) {
+        return slot;
+    }
+    for (size_t i = 0; i < cat->super->capacity; i++) {
+        catalog_entry_t& e = cat->entries[i];
+        if (!(e.flags & GTFS_CATALOG_IN_USE)) {
+            memset(&e, 0, sizeof(e));
+            strncpy(e.name, filename.c_str(), MAX_FILENAME_LEN);
+            e.length = length;
+            e.flags = GTFS_CATALOG_IN_USE;
+            cat->slots[filename] = i;
+            return i;
+        }
+    }
+    ERROR_PRINT("catalog full\n");
+    return catalog_none;
+}
+
+// Base files of the directory, as gtfs_catalog_scan lists them, with their
+// lengths.
+static void catalog_scan_dir(catalog_t* cat, const string& dir) {
+    vector<pair<string, off_t> > stored = gtfs_blocks_list(dir);
+    for (size_t i = 0; i < stored.size(); i++) {
+        catalog_claim(cat, stored[i].first, stored[i].second > 0 ? stored[i].second - 1 : 0);
+    }
+    vector<string> files = gtfs_catalog_scan(dir);
+    for (size_t i = 0; i < files.size(); i++) {
+        struct stat s;
+        if (gtfs_io()->stat((dir + "/" + files[i]).c_str(), &s) == 0) {
+            catalog_claim(cat, files[i], s.st_size > 0 ? s.st_size - 1 : 0);
+        }
+    }
+}
+
+// Rebuilds the catalog from the directory. Every file with records in the
+// log is pending, since nothing says whether they were applied.
+static void catalog_rebuild(gtfs_t* gtfs, catalog_t* cat) {
+    DEBUG_PRINT(do_verbose, "rebuilding catalog of " << gtfs->dirname << "\n");
+    memset(cat->addr, 0, cat->size);
+    cat->slots.clear();
+    catalog_super_t* super = cat->super;
+    super->magic = GTFS_CATALOG_MAGIC;
+    super->version = GTFS_CATALOG_VERSION;
+    super->capacity = MAX_NUM_FILES_PER_DIR;
+    super->crc = catalog_super_crc(super);
+    catalog_scan_dir(cat, gtfs->dirname);
+
+    wal_image_t image;
+    if (gtfs_wal_load(gtfs_wal_dir(gtfs), image) == 0) {
+        for (size_t i = 0; i < image.records.size(); i++) {
+            size_t slot = catalog_find(cat, image.records[i].filename);
+            if (slot != catalog_none) {
+                cat->entries[slot].flags |= GTFS_CATALOG_PENDING;
+                cat->entries[slot].log_bytes += (uint64_t)image.records[i].stored_length;
+            }
+            super->log_bytes += (uint64_t)image.records[i].stored_length;
+        }
+        gtfs_wal_release(image);
+    }
+    catalog_sync(cat);
+}
+
+// Maps the catalog, rebuilding it if it is missing or invalid, then redoes
+// the records of the files it lists as pending.
+int gtfs_catalog_open(gtfs_t* gtfs) {
+    catalog_t* cat = new catalog_t();
+    cat->path = gtfs->dirname + "/" GTFS_CATALOG_NAME;
+    cat->pid = getpid();
+    cat->fd = gtfs_io()->open(cat->path.c_str(), O_CREAT|O_RDWR, S_IRWXU);
+    if (cat->fd < 0) {
+        delete cat;
+        return -1;
+    }
+    cat->size = GTFS_CATALOG_HEADER + MAX_NUM_FILES_PER_DIR * sizeof(catalog_entry_t);
+    gtfs_io()->flock(cat->fd, LOCK_EX);
+    struct stat s;
+    gtfs_io()->fstat(cat->fd, &s);
+    if ((size_t)s.st_size < cat->size && gtfs_io()->ftruncate(cat->fd, (off_t)cat->size) != 0) {
+        gtfs_io()->flock(cat->fd, LOCK_UN);
+        gtfs_io()->close(cat->fd);
+        delete cat;
+        return -1;
+    }
+    void* addr = gtfs_io()->mmap(NULL, cat->size, PROT_READ | PROT_WRITE, MAP_SHARED, cat->fd, 0);
+    if (addr == MAP_FAILED) {
+        gtfs_io()->flock(cat->fd, LOCK_UN);
+        gtfs_io()->close(cat->fd);
+        delete cat;
+        return -1;
+    }
+    cat->addr = (char*)addr;
+    cat->super = (catalog_super_t*)cat->addr;
+    cat->entries = (catalog_entry_t*)(cat->addr + GTFS_CATALOG_HEADER);
+    if (!catalog_valid(cat)) {
+        catalog_rebuild(gtfs, cat);
+    }
+    gtfs_io()->flock(cat->fd, LOCK_UN);
+    gtfs->catalog = cat;
+
+    vector<string> pending = gtfs_catalog_files(gtfs, true);
+    if (!pending.empty()) {
+        DEBUG_PRINT(do_verbose, pending.size() << " files with unapplied log records\n");
+        return gtfs_wal_recover(gtfs, pending);
+    }
+    return 0;
+}
+
+int gtfs_catalog_add(gtfs_t* gtfs, const string& filename, off_t length) {
+    catalog_t* cat = gtfs->catalog;
+    if (cat == NULL) {
+        return -1;
+    }
+    lock_guard<mutex> guard(cat->lock);
+    int fd = catalog_fd(cat);
+    gtfs_io()->flock(fd, LOCK_EX);
+    size_t slot = catalog_claim(cat, filename, length);
+    if (slot != catalog_none && cat->entries[slot].length < length) {
+        cat->entries[slot].length = length;
+    }
+    gtfs_io()->flock(fd, LOCK_UN);
+    return slot == catalog_none ? -1 : 0;
+}
+
+void gtfs_catalog_remove(gtfs_t* gtfs, const string& filename) {
+    catalog_t* cat = gtfs->catalog;
+    if (cat == NULL) {
+        return;
+    }
+    lock_guard<mutex> guard(cat->lock);
+    int fd = catalog_fd(cat);
+    gtfs_io()->flock(fd, LOCK_EX);
+    size_t slot = catalog_find(cat, filename);
+    if (slot != catalog_none) {
+        memset(&cat->entries[slot], 0, sizeof(catalog_entry_t));
+        cat->slots.erase(filename);
+    }
+    gtfs_io()->flock(fd, LOCK_UN);
+}
+
+// Called under the exclusive log lock before records for files are written.
+// Only the first record after a checkpoint pays for the msync.
+int gtfs_catalog_pending(gtfs_t* gtfs, const vector<string>& files) {
+    catalog_t* cat = gtfs->catalog;
+    if (cat == NULL) {
+        return 0;
+    }
+    lock_guard<mutex> guard(cat->lock);
+    int fd = catalog_fd(cat);
+    gtfs_io()->flock(fd, LOCK_EX);
+    bool changed = false;
+    int ret = 0;
+    for (size_t i = 0; i < files.size() && ret == 0; i++) {
+        size_t slot = catalog_claim(cat, files[i], 0);
+        if (slot == catalog_none) {
+            ret = -1;
+        } else if (!(cat->entries[slot].flags & GTFS_CATALOG_PENDING)) {
+            cat->entries[slot].flags |= GTFS_CATALOG_PENDING;
+            changed = true;
+        }
+    }
+    gtfs_io()->flock(fd, LOCK_UN);
+    if (changed && catalog_sync(cat) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+// Called under the exclusive log lock once bytes of records for files are
+// written; a batch of several files counts its bytes evenly against them.
+// writers[i], if given, logged the records for files[i].
+void gtfs_catalog_logged(gtfs_t* gtfs, const vector<string>& files, const vector<uint64_t>& writers,
+                         uint64_t lsn, size_t bytes) {
+    catalog_t* cat = gtfs->catalog;
+    if (cat == NULL) {
+        return;
+    }
+    lock_guard<mutex> guard(cat->lock);
+    cat->super->log_bytes += bytes;
+    for (size_t i = 0; i < files.size(); i++) {
+        size_t slot = catalog_find(cat, files[i]);
+        if (slot != catalog_none) {
+            catalog_entry_t& e = cat->entries[slot];
+            uint64_t writer = i < writers.size() ? writers[i] : 0;
+            if (writer == 0 || e.writer != writer) {
+                e.writer_from = e.last_lsn;
+                e.writer = writer;
+            }
+            e.last_lsn = lsn;
+            e.log_bytes += bytes / files.size();
+        }
+    }
+}
+
+// Called under the shared log lock once the file's records are in its base file.
+void gtfs_catalog_replayed(gtfs_t* gtfs, const string& filename) {
+    catalog_t* cat = gtfs->catalog;
+    if (cat == NULL) {
+        return;
+    }
+    lock_guard<mutex> guard(cat->lock);
+    size_t slot = catalog_find(cat, filename);
+    if (slot != catalog_none) {
+        cat->entries[slot].replayed_lsn = cat->entries[slot].last_lsn;
+    }
+}
+
+uint64_t gtfs_catalog_replayed_lsn(gtfs_t* gtfs, const string& filename) {
+    catalog_t* cat = gtfs->catalog;
+    if (cat == NULL) {
+        return 0;
+    }
+    lock_guard<mutex> guard(cat->lock);
+    size_t slot = catalog_find(cat, filename);
+    return slot == catalog_none ? 0 : cat->entries[slot].replayed_lsn;
+}
+
+bool gtfs_catalog_current(gtfs_t* gtfs, const string& filename, uint64_t since, uint64_t writer) {
+    catalog_t* cat = gtfs->catalog;
+    if (cat == NULL) {
+        return false;
+    }
+    lock_guard<mutex> guard(cat->lock);
+    size_t slot = catalog_find(cat, filename);
+    if (slot == catalog_none) {
+        return since == 0;
+    }
+    const catalog_entry_t& e = cat->entries[slot];
+    return e.last_lsn <= since || (writer != 0 && e.writer == writer && e.writer_from <= since);
+}
+
+// The files' records are durable in their base files.
+void gtfs_catalog_applied(gtfs_t* gtfs, const vector<string>& files) {
+    catalog_t* cat = gtfs->catalog;
+    if (cat == NULL) {
+        return;
+    }
+    lock_guard<mutex> guard(cat->lock);
+    for (size_t i = 0; i < files.size(); i++) {
+        size_t slot = catalog_find(cat, files[i]);
+        if (slot != catalog_none) {
+            cat->entries[slot].flags &= ~(uint32_t)GTFS_CATALOG_PENDING;
+            cat->entries[slot].applied_lsn = cat->entries[slot].last_lsn;
+            cat->entries[slot].replayed_lsn = cat->entries[slot].last_lsn;
+        }
+    }
+    catalog_sync(cat);
+}
+
+void gtfs_catalog_checkpointed(gtfs_t* gtfs, uint64_t lsn) {
+    catalog_t* cat = gtfs->catalog;
+    if (cat == NULL) {
+        return;
+    }
+    lock_guard<mutex> guard(cat->lock);
+    for (size_t i = 0; i < cat->super->capacity; i++) {
+        catalog_entry_t& e = cat->entries[i];
+        if (e.flags & GTFS_CATALOG_IN_USE) {
+            e.flags &= ~(uint32_t)GTFS_CATALOG_PENDING;
+            e.applied_lsn = e.last_lsn;
+            e.replayed_lsn = e.last_lsn;
+            e.log_bytes = 0;
+        }
+    }
+    cat->super->checkpoint_lsn = lsn;
+    cat->super->log_bytes = 0;
+    cat->super->checkpoints++;
+    catalog_sync(cat);
+}
+
+vector<string> gtfs_catalog_files(gtfs_t* gtfs, bool pending_only) {
+    vector<string> files;
+    catalog_t* cat = gtfs->catalog;
+    if (cat == NULL) {
+        return files;
+    }
+    lock_guard<mutex> guard(cat->lock);
+    for (size_t i = 0; i < cat->super->capacity; i++) {
+        const catalog_entry_t& e = cat->entries[i];
+        if ((e.flags & GTFS_CATALOG_IN_USE) && (!pending_only || (e.flags & GTFS_CATALOG_PENDING))) {
+            files.push_back(e.name);
+        }
+    }
+    return files;
+}
+
+void gtfs_catalog_backlog(gtfs_t* gtfs, const vector<string>& files, uint64_t& total, uint64_t& largest) {
+    total = 0;
+    largest = 0;
+    catalog_t* cat = gtfs->catalog;
+    if (cat == NULL) {
+        return;
+    }
+    lock_guard<mutex> guard(cat->lock);
+    total = cat->super->log_bytes;
+    for (size_t i = 0; i < files.size(); i++) {
+        size_t slot = catalog_find(cat, files[i]);
+        if (slot != catalog_none && cat->entries[slot].log_bytes > largest) {
+            largest = cat->entries[slot].log_bytes;
+        }
+    }
+}
+
+static bool catalog_ends_with(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Temporaries are named after their target plus ".tmp" (a copy between
+// roots) or ".tmp.<pid>" (a dictionary or a file restored from the block store).
+static bool catalog_is_temp(const string& fname) {
+    if (catalog_ends_with(fname, ".tmp")) {
+        return true;
+    }
+    size_t at = fname.rfind(".tmp.");
+    return at != string::npos && at + 5 < fname.size() &&
+           fname.find_first_not_of("0123456789", at + 5) == string::npos;
+}
+
+// Names starting with '.' are the directory's own: the catalog, the log, the
+// block store and follower state.
+vector<string> gtfs_catalog_scan(const string& dir) {
+    vector<string> files;
+    vector<string> names;
+    if (gtfs_io()->list(dir.c_str(), &names) != 0) {
+        return files;
+    }
+    for (size_t i = 0; i < names.size(); i++) {
+        const string& fname = names[i];
+        if (fname[0] == '.' || fname.size() > MAX_FILENAME_LEN ||
+            catalog_ends_with(fname, ".dict") || catalog_is_temp(fname)) {
+            continue;
+        }
+        struct stat s;
+        if (gtfs_io()->stat((dir + "/" + fname).c_str(), &s) == 0 && S_ISREG(s.st_mode)) {
+            files.push_back(fname);
+        }
+    }
+    vector<pair<string, off_t> > stored = gtfs_blocks_list(dir);
+    for (size_t i = 0; i < stored.size(); i++) {
+        if (find(files.begin(), files.end(), stored[i].first) == files.end()) {
+            files.push_back(stored[i].first);
+        }
+    }
+    return files;
+}
@@ -0,0 +1,96 @@
+#ifndef GTFS_CATALOG
+#define GTFS_CATALOG
+
+#include "gtfs.hpp"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+
+// Persistent catalog of a GTFileSystem directory, kept in <dir>/.catalog and
+// mapped shared by every process using the directory. A superblock is
+// followed by one fixed slot per file holding its length and log state.
+//
+// A file is marked pending, durably and under the log lock, before the first
+// record for it after a checkpoint is written, and the mark is only cleared
+// once its records are in the base file. gtfs_init therefore knows which
+// files need recovery without reading the log, and redoes just those. A
+// missing or invalid catalog is rebuilt from the directory and the log.
+//
+// Writers are file_t handles, each with its own private mapping. The catalog
+// remembers which one logged a file's last records, so a writer can tell
+// whether its mapping still holds every committed byte of the file, and with
+// it whether a before-image taken from the mapping is a valid delta base.
+//
+// Log positions (LSNs) are segment sequence << GTFS_CATALOG_LSN_SHIFT plus
+// the offset within the segment.
+
+#define GTFS_CATALOG_NAME ".catalog"
+#define GTFS_CATALOG_MAGIC 0x54414347u   // "GCAT"
+#define GTFS_CATALOG_VERSION 3
+#define GTFS_CATALOG_HEADER 4096
+#define GTFS_CATALOG_LSN_SHIFT 40
+
+#define GTFS_CATALOG_IN_USE  0x1
+#define GTFS_CATALOG_PENDING 0x2   // may have log records not yet in the base file
+
+typedef struct catalog_super {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t crc;              // over the fields above
+    uint64_t checkpoint_lsn;   // every record before it is in a base file
+    uint64_t checkpoints;
+    uint64_t log_bytes;        // logged since the last checkpoint
+} catalog_super_t;
+
+typedef struct catalog_entry {
+    char name[MAX_FILENAME_LEN + 1];
+    uint32_t flags;
+    int64_t length;
+    uint64_t last_lsn;         // end of the file's last logged record
+    uint64_t applied_lsn;      // records up to here are in the base file
+    uint64_t log_bytes;        // logged for the file since the last checkpoint
+    uint64_t replayed_lsn;     // records up to here are in the base file, durable or not
+    uint64_t writer;           // who logged the last record, 0 if unknown
+    uint64_t writer_from;      // end of the last record anyone else logged
+} catalog_entry_t;
+
+typedef struct catalog {
+    std::string path;
+    pid_t pid;                 // fd belongs to this process; a forked child reopens
+    int fd;                    // carries the flock serializing slot changes
+    char* addr;
+    size_t size;
+    catalog_super_t* super;
+    catalog_entry_t* entries;
+    std::map<std::string, size_t> slots;   // name -> slot, as last seen
+    std::mutex lock;
+} catalog_t;
+
+int gtfs_catalog_open(gtfs_t* gtfs);
+int gtfs_catalog_add(gtfs_t* gtfs, const std::string& filename, off_t length);
+void gtfs_catalog_remove(gtfs_t* gtfs, const std::string& filename);
+
+int gtfs_catalog_pending(gtfs_t* gtfs, const std::vector<std::string>& files);
+void gtfs_catalog_logged(gtfs_t* gtfs, const std::vector<std::string>& files, const std::vector<uint64_t>& writers,
+                         uint64_t lsn, size_t bytes);
+void gtfs_catalog_replayed(gtfs_t* gtfs, const std::string& filename);
+// The LSN a mapping of filename made now starts out current with.
+uint64_t gtfs_catalog_replayed_lsn(gtfs_t* gtfs, const std::string& filename);
+// True if every record logged for filename after since came from writer.
+bool gtfs_catalog_current(gtfs_t* gtfs, const std::string& filename, uint64_t since, uint64_t writer);
+void gtfs_catalog_applied(gtfs_t* gtfs, const std::vector<std::string>& files);
+void gtfs_catalog_checkpointed(gtfs_t* gtfs, uint64_t lsn);
+
+std::vector<std::string> gtfs_catalog_files(gtfs_t* gtfs, bool pending_only);
+// Base files of dir as the directory itself lists them, on disk or in its
+// block store, without the directory's own state, dictionaries, temporaries
+// and names too long to open. A rebuilt catalog holds exactly these.
+std::vector<std::string> gtfs_catalog_scan(const std::string& dir);
+// Bytes logged since the last checkpoint in total, and for the one of files
+// with the most.
+void gtfs_catalog_backlog(gtfs_t* gtfs, const std::vector<std::string>& files, uint64_t& total, uint64_t& largest);
+
+#endif
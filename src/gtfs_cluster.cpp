@@ -0,0 +1,289 @@
+#include "gtfs.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_io.hpp"
+#include "gtfs_wal.hpp"
+#include "gtfs_catalog.hpp"
+#include "gtfs_blocks.hpp"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+using namespace std;
+
+// Every directory owns GTFS_CLUSTER_VNODES points on a 32-bit ring and a file
+// belongs to the first point at or after the hash of its name. Adding a
+// directory only takes over the arcs in front of its own points, so only the
+// files hashing into those arcs move.
+
+static unsigned int cluster_hash(const string& key) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < key.size(); i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    // FNV alone clusters similar names; finish with a murmur3 avalanche.
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static void cluster_add_points(map<unsigned int, int>& ring, const string& dir, int shard) {
+    for (int i = 0; i < GTFS_CLUSTER_VNODES; i++) {
+        ring.insert(make_pair(cluster_hash(dir + "#" + to_string(i)), shard));
+    }
+}
+
+static int cluster_owner(gtfs_cluster_t* cluster, const string& filename) {
+    map<unsigned int, int>::iterator it = cluster->ring.lower_bound(cluster_hash(filename));
+    if (it == cluster->ring.end()) {
+        it = cluster->ring.begin();
+    }
+    return it->second;
+}
+
+// Moves src to dst. Shards normally sit on different devices, so a failed
+// rename falls back to copying into a temporary name that is renamed into
+// place before the source is unlinked.
+static int cluster_move(const string& src, const string& dst) {
+    if (gtfs_io()->rename(src.c_str(), dst.c_str()) == 0) {
+        return 0;
+    }
+    if (errno != EXDEV) {
+        return -1;
+    }
+
+    string tmp = dst + ".tmp";
+    int sfd = gtfs_io()->open(src.c_str(), O_RDONLY);
+    if (sfd < 0) {
+        return -1;
+    }
+    int dfd = gtfs_io()->open(tmp.c_str(), O_CREAT|O_TRUNC|O_WRONLY, S_IRWXU);
+    if (dfd < 0) {
+        gtfs_io()->close(sfd);
+        return -1;
+    }
+    int ret = 0;
+    char buf[65536];
+    ssize_t n;
+    while ((n = gtfs_io()->read(sfd, buf, sizeof(buf))) > 0) {
+        if (gtfs_io()->write(dfd, buf, (size_t)n) != n) {
+            ret = -1;
+            break;
+        }
+    }
+    if (n < 0 || gtfs_io()->fdatasync(dfd) != 0) {
+        ret = -1;
+    }
+    gtfs_io()->close(dfd);
+    gtfs_io()->close(sfd);
+    if (ret != 0 || gtfs_io()->rename(tmp.c_str(), dst.c_str()) != 0) {
+        gtfs_io()->unlink(tmp.c_str());
+        return -1;
+    }
+    return gtfs_io()->unlink(src.c_str());
+}
+
+gtfs_cluster_t* gtfs_cluster_init(vector<string> directories, int verbose_flag, int flags) {
+    gtfs_cluster_t* cluster = NULL;
+    if (directories.empty()) {
+        return NULL;
+    }
+
+    cluster = new gtfs_cluster_t();
+    for (size_t i = 0; i < directories.size(); i++) {
+        gtfs_t* gtfs = gtfs_init(directories[i], verbose_flag, flags);
+        if (gtfs == NULL) {
+            ERROR_PRINT("Cannot initialize cluster root " << directories[i] << "\n");
+            delete cluster;
+            return NULL;
+        }
+        cluster->shards.push_back(gtfs);
+        cluster_add_points(cluster->ring, directories[i], (int)i);
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
+    return cluster;
+}
+
+// Shards share nothing, so each one is checkpointed by its own thread.
+int gtfs_cluster_clean(gtfs_cluster_t* cluster) {
+    int ret = -1;
+    if (cluster) {
+        VERBOSE_PRINT(do_verbose, "Cleaning up " << cluster->shards.size() << " cluster roots\n");
+
+        vector<int> results(cluster->shards.size(), 0);
+        vector<thread> workers;
+        for (size_t i = 0; i < cluster->shards.size(); i++) {
+            workers.push_back(thread([cluster, &results, i]() {
+                results[i] = gtfs_clean(cluster->shards[(size_t)i]);
+            }));
+        }
+        ret = 0;
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+            if (results[i] != 0) {
+                ret = -1;
+            }
+        }
+
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem cluster does not exist\n");
+        return ret;
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+// Moves a file and its dictionary from one root to another.
+static int cluster_move_file(const string& from, const string& to) {
+    bool dict = gtfs_io()->access((from + ".dict").c_str(), F_OK) == 0;
+    if (dict && cluster_move(from + ".dict", to + ".dict") != 0) {
+        ERROR_PRINT("Cannot move " << from << ".dict\n");
+        return -1;
+    }
+    if (cluster_move(from, to) != 0) {
+        ERROR_PRINT("Cannot move " << from << "\n");
+        if (dict && cluster_move(to + ".dict", from + ".dict") != 0) {
+            ERROR_PRINT("Cannot move " << to << ".dict back\n");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Adds a root and moves the files it now owns. Roots that lose files are
+// cleaned first so only base files and dictionaries travel. Fails without
+// changing anything if such a file is open, or if a file cannot be moved: the
+// files moved so far go back to their roots.
+int gtfs_cluster_add_root(gtfs_cluster_t* cluster, string directory) {
+    int ret = -1;
+    if (cluster) {
+        VERBOSE_PRINT(do_verbose, "Adding cluster root " << directory << "\n");
+
+        for (size_t i = 0; i < cluster->shards.size(); i++) {
+            if (cluster->shards[i]->dirname == directory) {
+                ERROR_PRINT("Cluster root " << directory << " already present\n");
+                return ret;
+            }
+        }
+        struct stat dir_info;
+        if (gtfs_io()->stat(directory.c_str(), &dir_info) != 0 || !S_ISDIR(dir_info.st_mode)) {
+            ERROR_PRINT("Cluster root " << directory << " is not a directory\n");
+            return ret;
+        }
+
+        gtfs_cluster_t next;
+        next.ring = cluster->ring;
+        int added = (int)cluster->shards.size();
+        cluster_add_points(next.ring, directory, added);
+
+        vector<pair<int, string> > moves;
+        for (int i = 0; i < added; i++) {
+            gtfs_t* shard = cluster->shards[(size_t)i];
+            vector<string> files = gtfs_catalog_scan(shard->dirname);
+            for (size_t j = 0; j < files.size(); j++) {
+                if (cluster_owner(&next, files[j]) != added) {
+                    continue;
+                }
+                bool busy;
+                {
+                    lock_guard<mutex> guard(*shard->files_lock);
+                    busy = shard->file_add_dict->find(files[j]) != shard->file_add_dict->end();
+                }
+                if (busy) {
+                    ERROR_PRINT("File " << files[j] << " must move but is open\n");
+                    return ret;
+                }
+                moves.push_back(make_pair(i, files[j]));
+            }
+        }
+
+        for (int i = 0; i < added; i++) {
+            for (size_t j = 0; j < moves.size(); j++) {
+                if (moves[j].first == i) {
+                    gtfs_clean(cluster->shards[(size_t)i]);
+                    break;
+                }
+            }
+        }
+        // The new root gets its GTFileSystem only once every file is there,
+        // so a failed move leaves nothing to free.
+        size_t done = 0;
+        gtfs_t* gtfs = NULL;
+        for (; done < moves.size(); done++) {
+            string from = cluster->shards[(size_t)moves[done].first]->dirname + "/" + moves[done].second;
+            string to = directory + "/" + moves[done].second;
+            if (gtfs_blocks_restore(cluster->shards[(size_t)moves[done].first], moves[done].second) != 0) {
+                ERROR_PRINT("Cannot restore " << from << " from the block store\n");
+                break;
+            }
+            if (cluster_move_file(from, to) != 0) {
+                break;
+            }
+        }
+        if (done == moves.size()) {
+            gtfs = gtfs_init(directory, do_verbose, cluster->shards[0]->flags);
+        }
+        if (gtfs == NULL) {
+            while (done-- > 0) {
+                string from = cluster->shards[(size_t)moves[done].first]->dirname + "/" + moves[done].second;
+                if (cluster_move_file(directory + "/" + moves[done].second, from) != 0) {
+                    ERROR_PRINT("Cannot move " << moves[done].second << " back to its root\n");
+                }
+            }
+            return ret;
+        }
+        for (size_t i = 0; i < moves.size(); i++) {
+            struct stat s;
+            gtfs_catalog_remove(cluster->shards[(size_t)moves[i].first], moves[i].second);
+            if (gtfs_io()->stat((directory + "/" + moves[i].second).c_str(), &s) == 0) {
+                gtfs_catalog_add(gtfs, moves[i].second, s.st_size > 0 ? s.st_size - 1 : 0);
+            }
+        }
+        DEBUG_PRINT(do_verbose, "moved " << moves.size() << " files to " << directory << "\n");
+
+        cluster->shards.push_back(gtfs);
+        cluster->ring.swap(next.ring);
+        ret = 0;
+
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem cluster does not exist\n");
+        return ret;
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+gtfs_t* gtfs_cluster_shard(gtfs_cluster_t* cluster, string filename) {
+    if (cluster == NULL || cluster->ring.empty()) {
+        return NULL;
+    }
+    return cluster->shards[(size_t)cluster_owner(cluster, filename)];
+}
+
+file_t* gtfs_cluster_open_file(gtfs_cluster_t* cluster, string filename, off_t file_length, int flags) {
+    gtfs_t* gtfs = gtfs_cluster_shard(cluster, filename);
+    if (gtfs == NULL) {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem cluster does not exist\n");
+        return NULL;
+    }
+    return gtfs_open_file(gtfs, filename, file_length, flags);
+}
+
+int gtfs_cluster_close_file(gtfs_cluster_t* cluster, file_t* fl) {
+    if (cluster == NULL || fl == NULL) {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem cluster or file does not exist\n");
+        return -1;
+    }
+    return gtfs_close_file(fl->gtfs, fl);
+}
@@ -0,0 +1,110 @@
+#include "gtfs_combine.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_log.hpp"
+
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+extern int do_verbose;
+
+void gtfs_combine_add(combine_t* cb, off_t offset, const char* data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (cb->extents.empty()) {
+        clock_gettime(CLOCK_MONOTONIC, &cb->first);
+    }
+    off_t end = offset + (off_t)length;
+    map<off_t, string>::iterator from = cb->extents.upper_bound(offset);
+    if (from != cb->extents.begin()) {
+        map<off_t, string>::iterator prev = from;
+        --prev;
+        if (prev->first + (off_t)prev->second.size() >= offset) {
+            from = prev;
+        }
+    }
+    // Every extent from `from` up to `to` overlaps or touches the write.
+    off_t start = offset, stop = end;
+    map<off_t, string>::iterator to = from;
+    for (; to != cb->extents.end() && to->first <= end; ++to) {
+        start = min(start, to->first);
+        stop = max(stop, to->first + (off_t)to->second.size());
+    }
+    string merged((size_t)(stop - start), '\0');
+    for (map<off_t, string>::iterator it = from; it != to; ++it) {
+        memcpy(&merged[(size_t)(it->first - start)], it->second.data(), it->second.size());
+        cb->bytes -= it->second.size();
+    }
+    memcpy(&merged[(size_t)(offset - start)], data, length);
+    cb->extents.erase(from, to);
+    cb->bytes += merged.size();
+    cb->extents[start].swap(merged);
+}
+
+bool gtfs_combine_due(combine_t* cb) {
+    return gtfs_combine_wait_ms(cb) == 0;
+}
+
+long gtfs_combine_wait_ms(combine_t* cb) {
+    if (cb->extents.empty()) {
+        return -1;
+    }
+    if (cb->bytes >= GTFS_COMBINE_MAX) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (now.tv_sec - cb->first.tv_sec) * 1000 + (now.tv_nsec - cb->first.tv_nsec) / 1000000;
+    return ms >= GTFS_COMBINE_DELAY_MS ? 0 : GTFS_COMBINE_DELAY_MS - ms;
+}
+
+// One delta record over the span of the extents, each extent a run. A span
+// too long for a delta gets one raw record per extent.
+size_t gtfs_combine_encode(combine_t* cb, const string& filename, string& buf) {
+    if (cb->extents.empty()) {
+        return 0;
+    }
+    off_t start = cb->extents.begin()->first;
+    off_t stop = cb->extents.rbegin()->first + (off_t)cb->extents.rbegin()->second.size();
+    log_record_t rec;
+    rec.filename = filename;
+    rec.dict_id = 0;
+    size_t n = 0;
+    if (stop - start <= INT_MAX) {
+        string packed;
+        off_t pos = start;
+        for (map<off_t, string>::iterator it = cb->extents.begin(); it != cb->extents.end(); ++it) {
+            gtfs_delta_put_run(packed, (unsigned int)(it->first - pos), it->second.data(), (unsigned int)it->second.size());
+            pos = it->first + (off_t)it->second.size();
+        }
+        rec.length = stop - start;
+        rec.offset = start;
+        rec.encoding = GTFS_ENC_DELTA;
+        rec.payload = packed.data();
+        rec.stored_length = (int64_t)packed.size();
+        gtfs_log_encode(buf, rec);
+        n = 1;
+    } else {
+        for (map<off_t, string>::iterator it = cb->extents.begin(); it != cb->extents.end(); ++it) {
+            rec.length = (int64_t)it->second.size();
+            rec.offset = it->first;
+            rec.encoding = GTFS_ENC_RAW;
+            rec.payload = it->second.data();
+            rec.stored_length = rec.length;
+            gtfs_log_encode(buf, rec);
+            n++;
+        }
+    }
+    DEBUG_PRINT(do_verbose, "combined " << cb->bytes << " bytes in " << cb->extents.size() << " extents of "
+                << filename << " into " << n << " records\n");
+    return n;
+}
+
+void gtfs_combine_done(combine_t* cb, size_t records) {
+    cb->extents.clear();
+    cb->bytes = 0;
+    cb->records += records;
+}
@@ -0,0 +1,67 @@
+#ifndef GTFS_COMBINE
+#define GTFS_COMBINE
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <time.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Write combining for files opened with GTFS_OPEN_COMBINE. Syncing a write to
+// such a file does not log it; its bytes are merged into the file's buffer of
+// synced extents, adjacent and overlapping ones into one with the newer bytes
+// on top. The buffer goes to the log as one delta record whose runs are the
+// extents when it holds GTFS_COMBINE_MAX bytes, once the oldest buffered
+// write was synced GTFS_COMBINE_DELAY_MS ago, or at a barrier:
+// gtfs_flush_file, gtfs_sync_write_files on the file, closing it and
+// gtfs_clean. Buffers that come due with no sync to log them are logged by a
+// flusher thread, one per process and GTFileSystem, started by the first
+// buffered write. Closing the last GTFS_OPEN_COMBINE file stops it and joins
+// it; the next buffered write starts another.
+//
+// A synced write is visible to readers at once but only durable once its
+// buffer is logged, about GTFS_COMBINE_DELAY_MS later. Pending writes are not
+// in the buffer and abort as usual.
+
+#define GTFS_COMBINE_MAX ((size_t)1 << 20)
+#define GTFS_COMBINE_DELAY_MS 10
+
+typedef struct combine {
+    std::map<off_t, std::string> extents;   // disjoint and never adjacent
+    size_t bytes;
+    struct timespec first;  // when the oldest buffered write was synced
+    size_t writes;          // synced writes merged since open
+    size_t records;         // log records they went out as
+    std::mutex lock;        // held from merging a write until its record is logged
+} combine_t;
+
+typedef struct combine_flusher {
+    std::thread thread;
+    bool stop;            // ends the thread; set under the set's lock
+} combine_flusher_t;
+
+// Open GTFS_OPEN_COMBINE files of a GTFileSystem, for gtfs_clean and the
+// flusher. The set's lock is taken before a buffer's.
+typedef struct combine_set {
+    std::vector<struct file*> files;
+    std::mutex lock;
+    std::condition_variable cv;   // wakes the flusher when a buffer fills or it is stopped
+    combine_flusher_t* flusher;   // NULL for none
+    pid_t flusher_pid;            // process that started flusher; a forked child has no thread of it
+} combine_set_t;
+
+// The calls below expect cb->lock to be held.
+void gtfs_combine_add(combine_t* cb, off_t offset, const char* data, size_t length);
+bool gtfs_combine_due(combine_t* cb);
+// Milliseconds until the buffer is due, -1 if it is empty.
+long gtfs_combine_wait_ms(combine_t* cb);
+// Appends the buffer to buf as log records of filename and returns how many.
+// The buffer is kept until gtfs_combine_done, once the records are logged.
+size_t gtfs_combine_encode(combine_t* cb, const std::string& filename, std::string& buf);
+void gtfs_combine_done(combine_t* cb, size_t records);
+
+#endif
@@ -0,0 +1,204 @@
+#include "gtfs_compress.hpp"
+
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 13
+#define LZ_MAX_OFFSET 0xFFFF
+
+static inline uint32_t lz_read32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static void lz_put_length(string& out, int len) {
+    while (len >= 255) {
+        out.push_back((char)255);
+        len -= 255;
+    }
+    out.push_back((char)len);
+}
+
+static void lz_emit(string& out, const char* lit, int lit_len, int offset, int match_len) {
+    int lit_nib = lit_len < 15 ? lit_len : 15;
+    int match_nib = 0;
+    if (match_len > 0) {
+        match_nib = match_len - LZ_MIN_MATCH < 15 ? match_len - LZ_MIN_MATCH : 15;
+    }
+    out.push_back((char)((lit_nib << 4) | match_nib));
+    if (lit_nib == 15) {
+        lz_put_length(out, lit_len - 15);
+    }
+    out.append(lit, (size_t)lit_len);
+    if (match_len > 0) {
+        out.push_back((char)(offset & 0xFF));
+        out.push_back((char)((offset >> 8) & 0xFF));
+        if (match_nib == 15) {
+            lz_put_length(out, match_len - LZ_MIN_MATCH - 15);
+        }
+    }
+}
+
+int gtfs_lz_compress(const char* dict, int dict_len, const char* src, int src_len, string& out) {
+    out.clear();
+    if (dict_len > GTFS_LZ_MAX_DICT) {
+        dict += dict_len - GTFS_LZ_MAX_DICT;
+        dict_len = GTFS_LZ_MAX_DICT;
+    }
+
+    // Dictionary and input share one address space so offsets can cross over.
+    vector<char> buf((size_t)(dict_len + src_len));
+    if (dict_len > 0) {
+        memcpy(buf.data(), dict, (size_t)dict_len);
+    }
+    memcpy(buf.data() + dict_len, src, (size_t)src_len);
+    const char* b = buf.data();
+
+    vector<int> table((size_t)1 << LZ_HASH_BITS, -1);
+    for (int i = 0; i + LZ_MIN_MATCH <= dict_len; i++) {
+        table[lz_hash(lz_read32(b + i))] = i;
+    }
+
+    int end = dict_len + src_len;
+    int ip = dict_len;
+    int anchor = ip;
+    out.reserve((size_t)src_len);
+
+    while (ip + LZ_MIN_MATCH <= end) {
+        uint32_t h = lz_hash(lz_read32(b + ip));
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || lz_read32(b + ref) != lz_read32(b + ip)) {
+            ip++;
+            continue;
+        }
+
+        int len = LZ_MIN_MATCH;
+        while (ip + len < end && b[ref + len] == b[ip + len]) {
+            len++;
+        }
+        lz_emit(out, b + anchor, ip - anchor, ip - ref, len);
+        if ((int)out.size() >= src_len) {
+            return -1;
+        }
+
+        ip += len;
+        anchor = ip;
+        if (ip - 2 >= dict_len && ip - 2 + LZ_MIN_MATCH <= end) {
+            table[lz_hash(lz_read32(b + ip - 2))] = ip - 2;
+        }
+    }
+
+    lz_emit(out, b + anchor, end - anchor, 0, 0);
+    if ((int)out.size() >= src_len) {
+        return -1;
+    }
+    return (int)out.size();
+}
+
+static bool lz_get_length(const unsigned char*& ip, const unsigned char* end, int& len) {
+    unsigned char c;
+    do {
+        if (ip >= end) {
+            return false;
+        }
+        c = *ip++;
+        len += c;
+    } while (c == 255);
+    return true;
+}
+
+int gtfs_lz_decompress(const char* dict, int dict_len, const char* src, int src_len, char* dst, int dst_len) {
+    if (dict_len > GTFS_LZ_MAX_DICT) {
+        dict += dict_len - GTFS_LZ_MAX_DICT;
+        dict_len = GTFS_LZ_MAX_DICT;
+    }
+
+    vector<char> buf((size_t)(dict_len + dst_len));
+    if (dict_len > 0) {
+        memcpy(buf.data(), dict, (size_t)dict_len);
+    }
+    char* b = buf.data();
+    int op = dict_len;
+    int out_end = dict_len + dst_len;
+
+    const unsigned char* ip = (const unsigned char*)src;
+    const unsigned char* end = ip + src_len;
+
+    while (ip < end) {
+        int token = *ip++;
+        int lit_len = token >> 4;
+        if (lit_len == 15 && !lz_get_length(ip, end, lit_len)) {
+            return -1;
+        }
+        if (lit_len > end - ip || lit_len > out_end - op) {
+            return -1;
+        }
+        memcpy(b + op, ip, (size_t)lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int match_len = (token & 0x0F);
+        if (match_len == 15 && !lz_get_length(ip, end, match_len)) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > out_end - op) {
+            return -1;
+        }
+        // Byte copy: overlapping matches replicate runs.
+        for (int i = 0; i < match_len; i++) {
+            b[op + i] = b[op - offset + i];
+        }
+        op += match_len;
+    }
+
+    if (op != out_end) {
+        return -1;
+    }
+    memcpy(dst, b + dict_len, (size_t)dst_len);
+    return 0;
+}
+
+bool gtfs_lz_worth_trying(const char* src, int src_len) {
+    if (src_len < GTFS_LZ_MIN_INPUT) {
+        return false;
+    }
+    int sample = src_len < 256 ? src_len : 256;
+    bool seen[256] = {false};
+    int distinct = 0;
+    for (int i = 0; i < sample; i++) {
+        unsigned char c = (unsigned char)src[i];
+        if (!seen[c]) {
+            seen[c] = true;
+            distinct++;
+        }
+    }
+    return distinct * 2 <= sample;
+}
+
+unsigned int gtfs_dict_id(const char* dict, int dict_len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < dict_len; i++) {
+        h ^= (unsigned char)dict[i];
+        h *= 16777619u;
+    }
+    return h;
+}
@@ -0,0 +1,25 @@
+#ifndef GTFS_COMPRESS
+#define GTFS_COMPRESS
+
+#include <string>
+
+// LZ77 block codec for log payloads (LZ4-style token/literal/offset sequences).
+// Matches may reference an optional dictionary that logically precedes the
+// input, so short records still compress against the file's typical content.
+
+#define GTFS_LZ_MAX_DICT 0xC000
+#define GTFS_LZ_MIN_INPUT 64
+
+// Returns the compressed size, or -1 if the output would not be smaller than
+// the input (the caller then stores the payload raw).
+int gtfs_lz_compress(const char* dict, int dict_len, const char* src, int src_len, std::string& out);
+
+// Returns 0 if exactly dst_len bytes were produced, -1 on malformed input.
+int gtfs_lz_decompress(const char* dict, int dict_len, const char* src, int src_len, char* dst, int dst_len);
+
+// Cheap estimate used to skip compressing payloads that look random.
+bool gtfs_lz_worth_trying(const char* src, int src_len);
+
+unsigned int gtfs_dict_id(const char* dict, int dict_len);
+
+#endif
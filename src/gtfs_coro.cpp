@@ -0,0 +1,141 @@
+#include "gtfs_coro.hpp"
+#include "gtfs_trace.hpp"
+
+using namespace std;
+
+namespace gtfs_co {
+
+namespace {
+
+// Owns a spawned task: frees itself when the task is done.
+struct detached {
+    struct promise_type {
+        detached get_return_object() noexcept { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { terminate(); }
+    };
+};
+
+detached start(loop* lp, task<void> t) {
+    co_await lp->schedule();
+    co_await t;
+    lp->finished();
+}
+
+} // namespace
+
+loop::loop(int nthreads) : threads(nthreads > 0 ? nthreads : 1), live(0), stopping(false) {
+    committer = thread(&loop::commit_loop, this);
+}
+
+loop::~loop() {
+    {
+        lock_guard<mutex> guard(op_lock);
+        stopping = true;
+    }
+    op_cv.notify_all();
+    committer.join();
+}
+
+void loop::spawn(task<void> t) {
+    {
+        lock_guard<mutex> guard(lock);
+        live++;
+    }
+    start(this, std::move(t));
+}
+
+void loop::post(coroutine_handle<> h) {
+    {
+        lock_guard<mutex> guard(lock);
+        ready.push_back(h);
+    }
+    cv.notify_one();
+}
+
+void loop::finished() {
+    lock_guard<mutex> guard(lock);
+    if (--live == 0) {
+        cv.notify_all();
+    }
+}
+
+void loop::work() {
+    unique_lock<mutex> guard(lock);
+    for (;;) {
+        cv.wait(guard, [this] { return !ready.empty() || live == 0; });
+        if (ready.empty()) {
+            return;
+        }
+        coroutine_handle<> h = ready.front();
+        ready.pop_front();
+        guard.unlock();
+        h.resume();
+        guard.lock();
+    }
+}
+
+void loop::run() {
+    vector<thread> workers;
+    for (int i = 1; i < threads; i++) {
+        workers.push_back(thread(&loop::work, this));
+    }
+    work();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+void loop::submit(detail::op* op) {
+    {
+        lock_guard<mutex> guard(op_lock);
+        ops.push_back(op);
+    }
+    op_cv.notify_one();
+}
+
+// Consecutive commits to one GTFileSystem become one gtfs_sync_write_files;
+// a checkpoint ends the group so it sees the commits queued before it.
+void loop::commit_loop() {
+    unique_lock<mutex> guard(op_lock);
+    for (;;) {
+        op_cv.wait(guard, [this] { return !ops.empty() || stopping; });
+        if (ops.empty()) {
+            return;
+        }
+        vector<detail::op*> batch;
+        batch.swap(ops);
+        guard.unlock();
+
+        size_t i = 0;
+        while (i < batch.size()) {
+            detail::op* first = batch[i];
+            if (first->kind == detail::op::CHECKPOINT) {
+                first->result = gtfs_clean(first->gtfs);
+                i++;
+                continue;
+            }
+            vector<write_t*> writes;
+            size_t j = i;
+            while (j < batch.size() && batch[j]->kind == detail::op::COMMIT && batch[j]->gtfs == first->gtfs) {
+                if (batch[j]->write != NULL) {
+                    writes.push_back(batch[j]->write);
+                }
+                j++;
+            }
+            int result = writes.empty() ? -1 : gtfs_sync_write_files(writes);
+            DEBUG_PRINT(do_verbose, "committed " << writes.size() << " coroutine writes together\n");
+            for (; i < j; i++) {
+                batch[i]->result = batch[i]->write != NULL ? result : -1;
+            }
+        }
+        for (size_t k = 0; k < batch.size(); k++) {
+            post(batch[k]->handle);
+        }
+        guard.lock();
+    }
+}
+
+} // namespace gtfs_co
@@ -0,0 +1,228 @@
+#ifndef GTFS_CORO
+#define GTFS_CORO
+
+#include "gtfs.hpp"
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// C++20 coroutine front-end. Needs a C++20 compiler and is built as its own
+// library, gtfs_coro; the rest of GTFileSystem stays C++11.
+//
+//     gtfs_co::task<void> update(gtfs_co::loop& lp, gtfs_t* g, file_t* fl) {
+//         write_t* w = co_await gtfs_co::write(g, fl, 0, 5, "hello");
+//         int ret = co_await gtfs_co::commit(lp, w);
+//         ...
+//     }
+//     gtfs_co::loop lp(2);
+//     lp.spawn(update(lp, g, fl));
+//     lp.run();
+//
+// Reads and writes copy to or from the mapping and complete in place. A
+// commit suspends the coroutine and queues its write for the loop's
+// committer thread, which takes everything queued while the previous group
+// was being made durable and syncs it with one gtfs_sync_write_files per
+// GTFileSystem, i.e. one log append and one fdatasync. Checkpoints go
+// through the same queue. Coroutines are resumed on the loop's worker
+// threads, so thousands of outstanding commits cost no threads and share
+// fdatasyncs.
+//
+// GCC 12 miscompiles a co_await used directly as an if condition; assign the
+// result to a variable first.
+
+namespace gtfs_co {
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+struct promise_base {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    // Resumes whoever awaited the task, if anyone did.
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+    T value{};
+    task<T> get_return_object();
+    void return_value(T v) { value = std::move(v); }
+};
+
+template <>
+struct promise<void> : promise_base {
+    task<void> get_return_object();
+    void return_void() {}
+};
+
+// One queued request for the committer thread.
+struct op {
+    enum kind_t { COMMIT, CHECKPOINT } kind;
+    gtfs_t* gtfs;
+    write_t* write;
+    int result;
+    std::coroutine_handle<> handle;
+};
+
+} // namespace detail
+
+// A lazily started coroutine. Awaiting it runs it and yields its co_return
+// value; the awaiter is resumed when it finishes.
+template <typename T>
+class task {
+public:
+    using promise_type = detail::promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    task(task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    T await_resume() {
+        if (handle.promise().error) {
+            std::rethrow_exception(handle.promise().error);
+        }
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(handle.promise().value);
+        }
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+task<T> detail::promise<T>::get_return_object() {
+    return task<T>(std::coroutine_handle<promise<T> >::from_promise(*this));
+}
+
+inline task<void> detail::promise<void>::get_return_object() {
+    return task<void>(std::coroutine_handle<promise<void> >::from_promise(*this));
+}
+
+class loop {
+public:
+    explicit loop(int threads = 1);
+    ~loop();
+    loop(const loop&) = delete;
+    loop& operator=(const loop&) = delete;
+
+    // Starts t on the loop. It runs once run() is called.
+    void spawn(task<void> t);
+    // Runs coroutines on the worker threads until every spawned task is done.
+    void run();
+
+    // Resumes h on a worker thread.
+    void post(std::coroutine_handle<> h);
+    // Hands op to the committer thread, which posts op->handle when done.
+    void submit(detail::op* op);
+
+    // Awaiting it moves the coroutine onto a worker thread.
+    struct schedule_awaiter {
+        loop* lp;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) { lp->post(h); }
+        void await_resume() const noexcept {}
+    };
+    schedule_awaiter schedule() { return schedule_awaiter{this}; }
+
+    void finished();
+
+private:
+    void work();
+    void commit_loop();
+
+    int threads;
+    size_t live;         // spawned tasks not yet finished
+    std::deque<std::coroutine_handle<> > ready;
+    std::mutex lock;
+    std::condition_variable cv;
+
+    std::vector<detail::op*> ops;
+    bool stopping;
+    std::mutex op_lock;
+    std::condition_variable op_cv;
+    std::thread committer;
+};
+
+// An awaitable that already has its value.
+template <typename T>
+struct ready_awaiter {
+    T value;
+    bool await_ready() const noexcept { return true; }
+    void await_suspend(std::coroutine_handle<>) const noexcept {}
+    T await_resume() { return value; }
+};
+
+// Suspends until the committer thread has run the operation.
+class op_awaiter {
+public:
+    op_awaiter(loop* l, detail::op::kind_t kind, gtfs_t* g, write_t* w) : lp(l) {
+        op.kind = kind;
+        op.gtfs = g;
+        op.write = w;
+        op.result = -1;
+    }
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        op.handle = h;
+        lp->submit(&op);
+    }
+    int await_resume() const noexcept { return op.result; }
+
+private:
+    loop* lp;
+    detail::op op;
+};
+
+inline ready_awaiter<char*> read(gtfs_t* g, file_t* fl, off_t offset, size_t length) {
+    return ready_awaiter<char*>{gtfs_read_file(g, fl, offset, length)};
+}
+
+inline ready_awaiter<write_t*> write(gtfs_t* g, file_t* fl, off_t offset, size_t length, const char* data) {
+    return ready_awaiter<write_t*>{gtfs_write_file(g, fl, offset, length, data)};
+}
+
+inline op_awaiter commit(loop& lp, write_t* w) {
+    return op_awaiter(&lp, detail::op::COMMIT, w && w->fl ? w->fl->gtfs : NULL, w);
+}
+
+inline op_awaiter checkpoint(loop& lp, gtfs_t* g) {
+    return op_awaiter(&lp, detail::op::CHECKPOINT, g, NULL);
+}
+
+} // namespace gtfs_co
+
+#endif
@@ -0,0 +1,141 @@
+#include "gtfs_epoch.hpp"
+#include "gtfs_trace.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+extern int do_verbose;
+
+typedef struct epoch_retired {
+    uint64_t epoch;
+    void (*reclaim)(void*);
+    void* arg;
+} epoch_retired_t;
+
+static atomic<uint64_t> epoch_global(1);
+static atomic<uint64_t> epoch_slots[GTFS_EPOCH_SLOTS];    // 0 while the slot's thread is outside
+static atomic<bool> epoch_owned[GTFS_EPOCH_SLOTS];
+static atomic<int> epoch_unslotted(0);
+static atomic<size_t> epoch_retired_count(0);
+static vector<epoch_retired_t> epoch_retired;
+static mutex epoch_lock;
+
+// Gives the slot back when its thread exits.
+struct epoch_slot {
+    int index;
+    int depth;
+    epoch_slot() : index(-1), depth(0) {
+        for (int i = 0; i < GTFS_EPOCH_SLOTS; i++) {
+            bool expected = false;
+            if (epoch_owned[i].compare_exchange_strong(expected, true)) {
+                index = i;
+                break;
+            }
+        }
+    }
+    ~epoch_slot() {
+        if (index >= 0) {
+            epoch_slots[index].store(0);
+            epoch_owned[index].store(false);
+        }
+    }
+};
+
+static epoch_slot& epoch_self() {
+    static thread_local epoch_slot self;
+    return self;
+}
+
+// Oldest epoch any thread is in, or UINT64_MAX if none is.
+static uint64_t epoch_oldest() {
+    if (epoch_unslotted.load() > 0) {
+        return 0;
+    }
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < GTFS_EPOCH_SLOTS; i++) {
+        uint64_t e = epoch_slots[i].load();
+        if (e != 0 && e < oldest) {
+            oldest = e;
+        }
+    }
+    return oldest;
+}
+
+// Runs the reclaim functions no thread can still depend on. Called with
+// epoch_lock held; the functions run after it is dropped.
+static void epoch_collect(unique_lock<mutex>& guard) {
+    uint64_t oldest = epoch_oldest();
+    vector<epoch_retired_t> ready;
+    for (size_t i = 0; i < epoch_retired.size();) {
+        if (epoch_retired[i].epoch < oldest) {
+            ready.push_back(epoch_retired[i]);
+            epoch_retired[i] = epoch_retired.back();
+            epoch_retired.pop_back();
+        } else {
+            i++;
+        }
+    }
+    epoch_retired_count.store(epoch_retired.size());
+    guard.unlock();
+    for (size_t i = 0; i < ready.size(); i++) {
+        ready[i].reclaim(ready[i].arg);
+    }
+    if (!ready.empty()) {
+        DEBUG_PRINT(do_verbose, "reclaimed " << ready.size() << " retired objects\n");
+    }
+}
+
+void gtfs_epoch_enter() {
+    epoch_slot& self = epoch_self();
+    if (self.depth++ > 0) {
+        return;
+    }
+    if (self.index < 0) {
+        epoch_unslotted++;
+        return;
+    }
+    // Publish, then re-read: a retire that advanced the epoch in between
+    // must see this thread as active in the epoch it then reads.
+    uint64_t e;
+    do {
+        e = epoch_global.load();
+        epoch_slots[self.index].store(e);
+    } while (epoch_global.load() != e);
+}
+
+void gtfs_epoch_exit() {
+    epoch_slot& self = epoch_self();
+    if (--self.depth > 0) {
+        return;
+    }
+    if (self.index < 0) {
+        epoch_unslotted--;
+    } else {
+        epoch_slots[self.index].store(0);
+    }
+    if (epoch_retired_count.load() > 0) {
+        unique_lock<mutex> guard(epoch_lock, try_to_lock);
+        if (guard.owns_lock()) {
+            epoch_collect(guard);
+        }
+    }
+}
+
+// Threads inside a section now entered at or before the tagged epoch; the
+// epoch moves on so later entrants are told apart from them.
+void gtfs_epoch_retire(void (*reclaim)(void*), void* arg) {
+    unique_lock<mutex> guard(epoch_lock);
+    epoch_retired_t r;
+    r.epoch = epoch_global.fetch_add(1);
+    r.reclaim = reclaim;
+    r.arg = arg;
+    epoch_retired.push_back(r);
+    epoch_collect(guard);
+}
+
+size_t gtfs_epoch_pending() {
+    return epoch_retired_count.load();
+}
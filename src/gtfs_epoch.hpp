@@ -0,0 +1,31 @@
+#ifndef GTFS_EPOCH
+#define GTFS_EPOCH
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Epoch-based reclamation. A thread touching memory that another thread may
+// retire (a file's mapping, its fd, its MVCC versions) stays inside an epoch
+// section for the duration, with a gtfs_epoch_guard on the stack. Retiring
+// hands the memory over with a function that frees it; the function runs once
+// every thread that was inside a section when it was retired has left it.
+//
+// Threads announce the epoch they entered in a fixed table of slots. A thread
+// that finds the table full counts as being in the oldest epoch, which holds
+// off reclamation until it leaves but is still safe.
+
+#define GTFS_EPOCH_SLOTS 128
+
+void gtfs_epoch_enter();
+void gtfs_epoch_exit();
+void gtfs_epoch_retire(void (*reclaim)(void*), void* arg);
+
+// Retired objects not yet reclaimed.
+size_t gtfs_epoch_pending();
+
+struct gtfs_epoch_guard {
+    gtfs_epoch_guard() { gtfs_epoch_enter(); }
+    ~gtfs_epoch_guard() { gtfs_epoch_exit(); }
+};
+
+#endif
@@ -0,0 +1,322 @@
+#include "gtfs_io.hpp"
+
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+
+using namespace std;
+
+/* posix */
+
+static int posix_stat(const char* path, struct stat* st) {
+    return ::stat(path, st);
+}
+
+static int posix_fstat(int fd, struct stat* st) {
+    return ::fstat(fd, st);
+}
+
+static int posix_list(const char* dir, vector<string>* names) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return -1;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        string name = ent->d_name;
+        if (name != "." && name != "..") {
+            names->push_back(name);
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+const gtfs_io_t gtfs_io_posix = {
+    "posix",
+    ::open, posix_stat, ::access, ::rename, ::link, ::unlink, ::mkdir, ::rmdir, posix_list,
+    ::close, ::read, ::write, ::pread, ::pwrite, ::preadv, ::lseek, posix_fstat, ::ftruncate, ::fallocate, ::posix_fadvise,
+    ::fsync, ::fdatasync, ::flock, ::mmap, ::msync, ::munmap, ::madvise,
+};
+
+/* memory */
+
+// Each file and directory is a memfd; opening one re-opens the memfd through
+// /proc so that every open has its own offset and flock, as on disk.
+static mutex mem_lock;
+static map<string, int> mem_files;
+static map<string, int> mem_dirs;
+
+static string mem_path(const char* path) {
+    string p;
+    for (const char* c = path; *c; c++) {
+        if (*c != '/' || p.empty() || p[p.size() - 1] != '/') {
+            p += *c;
+        }
+    }
+    if (p.size() > 1 && p[p.size() - 1] == '/') {
+        p.erase(p.size() - 1);
+    }
+    return p;
+}
+
+static string mem_parent(const string& p) {
+    size_t slash = p.rfind('/');
+    return slash == string::npos ? "" : slash == 0 ? "/" : p.substr(0, slash);
+}
+
+static int mem_fail(int err) {
+    errno = err;
+    return -1;
+}
+
+static int mem_reopen(int memfd, int flags) {
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", memfd);
+    int fd = ::open(proc, flags & ~(O_CREAT | O_EXCL | O_TRUNC | O_DIRECTORY | O_NOFOLLOW));
+    return fd >= 0 || errno == EINVAL ? fd : dup(memfd);
+}
+
+static int mem_open(const char* path, int flags, ...) {
+    lock_guard<mutex> guard(mem_lock);
+    string p = mem_path(path);
+    map<string, int>::iterator dir = mem_dirs.find(p);
+    if (dir != mem_dirs.end()) {
+        return (flags & O_ACCMODE) != O_RDONLY ? mem_fail(EISDIR) : mem_reopen(dir->second, O_RDONLY);
+    }
+    map<string, int>::iterator it = mem_files.find(p);
+    if (flags & O_DIRECTORY) {
+        return mem_fail(it == mem_files.end() ? ENOENT : ENOTDIR);
+    }
+    if (it != mem_files.end()) {
+        if ((flags & O_CREAT) && (flags & O_EXCL)) {
+            return mem_fail(EEXIST);
+        }
+        int fd = mem_reopen(it->second, flags);
+        if (fd >= 0 && (flags & O_TRUNC) && ::ftruncate(fd, 0) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    if (!(flags & O_CREAT) || mem_dirs.find(mem_parent(p)) == mem_dirs.end()) {
+        return mem_fail(ENOENT);
+    }
+    int memfd = memfd_create("gtfs", 0);
+    if (memfd < 0) {
+        return -1;
+    }
+    int fd = mem_reopen(memfd, flags);
+    if (fd < 0) {
+        ::close(memfd);
+        return -1;
+    }
+    mem_files[p] = memfd;
+    return fd;
+}
+
+static int mem_stat(const char* path, struct stat* st) {
+    lock_guard<mutex> guard(mem_lock);
+    string p = mem_path(path);
+    map<string, int>::iterator it = mem_files.find(p);
+    if (it != mem_files.end()) {
+        return ::fstat(it->second, st);
+    }
+    it = mem_dirs.find(p);
+    if (it == mem_dirs.end() || ::fstat(it->second, st) != 0) {
+        return mem_fail(ENOENT);
+    }
+    st->st_mode = S_IFDIR | S_IRWXU;
+    return 0;
+}
+
+static int mem_access(const char* path, int) {
+    lock_guard<mutex> guard(mem_lock);
+    string p = mem_path(path);
+    return mem_files.count(p) || mem_dirs.count(p) ? 0 : mem_fail(ENOENT);
+}
+
+static int mem_rename(const char* from, const char* to) {
+    lock_guard<mutex> guard(mem_lock);
+    string f = mem_path(from), t = mem_path(to);
+    map<string, int>::iterator it = mem_files.find(f);
+    if (it != mem_files.end()) {
+        if (mem_dirs.count(t)) {
+            return mem_fail(EISDIR);
+        }
+        int memfd = it->second;
+        mem_files.erase(it);
+        map<string, int>::iterator old = mem_files.find(t);
+        if (old != mem_files.end()) {
+            ::close(old->second);
+        }
+        mem_files[t] = memfd;
+        return 0;
+    }
+    if (!mem_dirs.count(f)) {
+        return mem_fail(ENOENT);
+    }
+    if (mem_files.count(t) || mem_dirs.count(t)) {
+        return mem_fail(EEXIST);
+    }
+    // Moves the directory and everything under it.
+    string prefix = f + "/";
+    map<string, int>* maps[] = {&mem_dirs, &mem_files};
+    for (int m = 0; m < 2; m++) {
+        map<string, int> moved;
+        for (map<string, int>::iterator e = maps[m]->begin(); e != maps[m]->end(); ) {
+            if (e->first == f || e->first.compare(0, prefix.size(), prefix) == 0) {
+                moved[t + e->first.substr(f.size())] = e->second;
+                maps[m]->erase(e++);
+            } else {
+                e++;
+            }
+        }
+        maps[m]->insert(moved.begin(), moved.end());
+    }
+    return 0;
+}
+
+static int mem_link(const char* from, const char* to) {
+    lock_guard<mutex> guard(mem_lock);
+    string f = mem_path(from), t = mem_path(to);
+    map<string, int>::iterator it = mem_files.find(f);
+    if (it == mem_files.end()) {
+        return mem_fail(ENOENT);
+    }
+    if (mem_files.count(t) || mem_dirs.count(t)) {
+        return mem_fail(EEXIST);
+    }
+    int memfd = dup(it->second);
+    if (memfd < 0) {
+        return -1;
+    }
+    mem_files[t] = memfd;
+    return 0;
+}
+
+static int mem_unlink(const char* path) {
+    lock_guard<mutex> guard(mem_lock);
+    string p = mem_path(path);
+    map<string, int>::iterator it = mem_files.find(p);
+    if (it == mem_files.end()) {
+        return mem_fail(mem_dirs.count(p) ? EISDIR : ENOENT);
+    }
+    ::close(it->second);
+    mem_files.erase(it);
+    return 0;
+}
+
+// Parents need not exist: the memory namespace has no root to hang them on.
+static int mem_mkdir(const char* path, mode_t) {
+    lock_guard<mutex> guard(mem_lock);
+    string p = mem_path(path);
+    if (mem_files.count(p) || mem_dirs.count(p)) {
+        return mem_fail(EEXIST);
+    }
+    int memfd = memfd_create("gtfs-dir", 0);
+    if (memfd < 0) {
+        return -1;
+    }
+    mem_dirs[p] = memfd;
+    return 0;
+}
+
+static bool mem_has_children(const string& dir) {
+    string prefix = dir + "/";
+    map<string, int>::iterator f = mem_files.lower_bound(prefix);
+    map<string, int>::iterator d = mem_dirs.lower_bound(prefix);
+    return (f != mem_files.end() && f->first.compare(0, prefix.size(), prefix) == 0) ||
+           (d != mem_dirs.end() && d->first.compare(0, prefix.size(), prefix) == 0);
+}
+
+static int mem_rmdir(const char* path) {
+    lock_guard<mutex> guard(mem_lock);
+    string p = mem_path(path);
+    map<string, int>::iterator it = mem_dirs.find(p);
+    if (it == mem_dirs.end()) {
+        return mem_fail(mem_files.count(p) ? ENOTDIR : ENOENT);
+    }
+    if (mem_has_children(p)) {
+        return mem_fail(ENOTEMPTY);
+    }
+    ::close(it->second);
+    mem_dirs.erase(it);
+    return 0;
+}
+
+static int mem_list(const char* dir, vector<string>* names) {
+    lock_guard<mutex> guard(mem_lock);
+    string p = mem_path(dir);
+    if (!mem_dirs.count(p)) {
+        return mem_fail(ENOENT);
+    }
+    map<string, int>* maps[] = {&mem_dirs, &mem_files};
+    for (int m = 0; m < 2; m++) {
+        for (map<string, int>::iterator e = maps[m]->begin(); e != maps[m]->end(); e++) {
+            if (e->first != p && mem_parent(e->first) == p) {
+                names->push_back(e->first.substr(p == "/" ? 1 : p.size() + 1));
+            }
+        }
+    }
+    return 0;
+}
+
+const gtfs_io_t gtfs_io_memory = {
+    "memory",
+    mem_open, mem_stat, mem_access, mem_rename, mem_link, mem_unlink, mem_mkdir, mem_rmdir, mem_list,
+    ::close, ::read, ::write, ::pread, ::pwrite, ::preadv, ::lseek, posix_fstat, ::ftruncate, ::fallocate, ::posix_fadvise,
+    ::fsync, ::fdatasync, ::flock, ::mmap, ::msync, ::munmap, ::madvise,
+};
+
+static std::atomic<const gtfs_io_t*> io_current(&gtfs_io_posix);
+
+const gtfs_io_t* gtfs_io() {
+    return io_current.load(std::memory_order_relaxed);
+}
+
+void gtfs_io_set(const gtfs_io_t* io) {
+    io_current = io ? io : &gtfs_io_posix;
+}
+
+const gtfs_io_t* gtfs_io_find(const string& name) {
+    if (name == gtfs_io_posix.name) {
+        return &gtfs_io_posix;
+    }
+    if (name == gtfs_io_memory.name) {
+        return &gtfs_io_memory;
+    }
+    return NULL;
+}
+
+int gtfs_io_read_file(const string& path, string& out) {
+    const gtfs_io_t* io = gtfs_io();
+    int fd = io->open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat s;
+    int ret = io->fstat(fd, &s);
+    if (ret == 0) {
+        out.resize((size_t)s.st_size);
+        size_t done = 0;
+        while (done < out.size()) {
+            ssize_t n = io->pread(fd, &out[done], out.size() - done, (off_t)done);
+            if (n <= 0) {
+                out.resize(done);
+                break;
+            }
+            done += (size_t)n;
+        }
+    }
+    io->close(fd);
+    return ret;
+}
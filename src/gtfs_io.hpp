@@ -0,0 +1,70 @@
+#ifndef GTFS_IO
+#define GTFS_IO
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+
+// Storage backends. Every file system call GTFileSystem makes goes through
+// the table of the current backend, so the storage underneath can be swapped
+// without touching the engines above it (mapped windows, the buffer pool,
+// the log). The backend is process-wide and chosen before the first
+// gtfs_init, either with gtfs_io_set() or with GTFS_IO=<name> in the
+// environment.
+//
+//   posix   the kernel's file system (default)
+//   memory  a process-local namespace of memfds: the same calls, mappings and
+//           locks, at RAM speed and with nothing left behind. Forked children
+//           inherit the files but not later changes to the namespace.
+//
+// The calls follow their POSIX namesakes, errno included.
+
+typedef struct gtfs_io_ops {
+    const char* name;
+
+    // Names
+    int (*open)(const char* path, int flags, ...);
+    int (*stat)(const char* path, struct stat* st);
+    int (*access)(const char* path, int mode);
+    int (*rename)(const char* from, const char* to);
+    int (*link)(const char* from, const char* to);
+    int (*unlink)(const char* path);
+    int (*mkdir)(const char* path, mode_t mode);
+    int (*rmdir)(const char* path);
+    int (*list)(const char* dir, std::vector<std::string>* names);   // without . and ..
+
+    // Open files
+    int (*close)(int fd);
+    ssize_t (*read)(int fd, void* buf, size_t len);
+    ssize_t (*write)(int fd, const void* buf, size_t len);
+    ssize_t (*pread)(int fd, void* buf, size_t len, off_t offset);
+    ssize_t (*pwrite)(int fd, const void* buf, size_t len, off_t offset);
+    ssize_t (*preadv)(int fd, const struct iovec* iov, int iovcnt, off_t offset);
+    off_t (*lseek)(int fd, off_t offset, int whence);
+    int (*fstat)(int fd, struct stat* st);
+    int (*ftruncate)(int fd, off_t length);
+    int (*fallocate)(int fd, int mode, off_t offset, off_t length);
+    int (*fadvise)(int fd, off_t offset, off_t length, int advice);
+    int (*fsync)(int fd);
+    int (*fdatasync)(int fd);
+    int (*flock)(int fd, int operation);
+    void* (*mmap)(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
+    int (*msync)(void* addr, size_t length, int flags);
+    int (*munmap)(void* addr, size_t length);
+    int (*madvise)(void* addr, size_t length, int advice);
+} gtfs_io_t;
+
+extern const gtfs_io_t gtfs_io_posix;
+extern const gtfs_io_t gtfs_io_memory;
+
+const gtfs_io_t* gtfs_io();
+void gtfs_io_set(const gtfs_io_t* io);
+// Backend called name, or NULL.
+const gtfs_io_t* gtfs_io_find(const std::string& name);
+
+// Whole content of path; -1 if it cannot be read.
+int gtfs_io_read_file(const std::string& path, std::string& out);
+
+#endif
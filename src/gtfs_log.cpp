@@ -0,0 +1,336 @@
+#include "gtfs_log.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_io.hpp"
+#include "gtfs_compress.hpp"
+#include "gtfs_simd.hpp"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sstream>
+
+using namespace std;
+
+extern int do_verbose;
+
+unsigned int gtfs_log_checksum(const log_record_t& rec) {
+    uint32_t crc = gtfs_crc32c(0, rec.filename.data(), rec.filename.size());
+    int64_t fields[5] = { rec.length, rec.offset, rec.encoding, rec.stored_length, (int64_t)rec.dict_id };
+    crc = gtfs_crc32c(crc, fields, sizeof(fields));
+    return gtfs_crc32c(crc, rec.payload, (size_t)rec.stored_length);
+}
+
+void gtfs_log_encode(string& out, const log_record_t& rec) {
+    std::stringstream ss;
+    ss << rec.filename << "\n" << rec.length << "\n" << rec.offset << "\n"
+       << rec.encoding << " " << rec.stored_length << " " << rec.dict_id << " "
+       << gtfs_log_checksum(rec) << "\n";
+    out.append(ss.str());
+    out.append(rec.payload, (size_t)rec.stored_length);
+    out.append("\n" GTFS_LOG_TERMINATOR "\n");
+}
+
+static bool log_read_line(const char* buf, size_t len, size_t& pos, string& line) {
+    const char* nl = (const char*)memchr(buf + pos, '\n', len - pos);
+    if (nl == NULL) {
+        return false;
+    }
+    line.assign(buf + pos, (size_t)(nl - (buf + pos)));
+    pos = (size_t)(nl - buf) + 1;
+    return true;
+}
+
+static bool log_parse_int(const string& s, long& v) {
+    if (s.empty()) {
+        return false;
+    }
+    char* end = NULL;
+    errno = 0;
+    v = strtol(s.c_str(), &end, 10);
+    return errno == 0 && end != s.c_str();
+}
+
+// "<encoding> <stored_length> <dict_id> <crc>"
+static bool log_parse_fields(const string& s, long& encoding, long& stored, unsigned long& dict_id, unsigned long& crc) {
+    const char* p = s.c_str();
+    char* end = NULL;
+    errno = 0;
+    encoding = strtol(p, &end, 10);
+    if (end == p) {
+        return false;
+    }
+    stored = strtol(p = end, &end, 10);
+    if (end == p) {
+        return false;
+    }
+    dict_id = strtoul(p = end, &end, 10);
+    if (end == p) {
+        return false;
+    }
+    crc = strtoul(p = end, &end, 10);
+    return end != p && errno == 0;
+}
+
+// Parses consecutive complete records starting at buf. Stops at the first
+// malformed or truncated record and returns the offset just past the last
+// good one.
+size_t gtfs_log_scan(const char* buf, size_t len, vector<log_record_t>& records) {
+    static const string terminator = "\n" GTFS_LOG_TERMINATOR "\n";
+    size_t pos = 0;
+    while (pos < len) {
+        size_t p = pos;
+        string name, s_len, s_off, s_enc;
+        if (!log_read_line(buf, len, p, name) || !log_read_line(buf, len, p, s_len) ||
+            !log_read_line(buf, len, p, s_off) || !log_read_line(buf, len, p, s_enc)) {
+            break;
+        }
+
+        long length, offset, encoding, stored;
+        unsigned long dict_id = 0, crc = 0;
+        if (!log_parse_int(s_len, length) || !log_parse_int(s_off, offset) ||
+            !log_parse_fields(s_enc, encoding, stored, dict_id, crc)) {
+            break;
+        }
+        if (length < 0 || offset < 0 || stored < 0 || encoding < 0 || encoding > INT32_MAX ||
+            (size_t)stored > len - p ||
+            len - p - (size_t)stored < terminator.size() ||
+            memcmp(buf + p + stored, terminator.data(), terminator.size()) != 0) {
+            break;
+        }
+        if (encoding == GTFS_ENC_RAW && stored != length) {
+            break;
+        }
+
+        log_record_t rec;
+        rec.filename = name;
+        rec.length = length;
+        rec.offset = offset;
+        rec.encoding = (int)encoding;
+        rec.dict_id = (unsigned int)dict_id;
+        rec.payload = buf + p;
+        rec.stored_length = stored;
+        rec.crc = (unsigned int)crc;
+        if (gtfs_log_checksum(rec) != rec.crc) {
+            break;
+        }
+        records.push_back(rec);
+        pos = p + (size_t)stored + terminator.size();
+    }
+    return pos;
+}
+
+static void delta_put_varint(string& out, unsigned int v) {
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static bool delta_get_varint(const unsigned char*& p, const unsigned char* end, unsigned int& v) {
+    v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (p >= end) {
+            return false;
+        }
+        unsigned int c = *p++;
+        v |= (c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void gtfs_delta_put_run(string& out, unsigned int skip, const char* data, unsigned int len) {
+    delta_put_varint(out, skip);
+    delta_put_varint(out, len);
+    out.append(data, len);
+}
+
+// Delta payload: a sequence of (skip, literal length, literal bytes) runs.
+// Unchanged gaps shorter than a run header are folded into the literal.
+// Returns the delta size, or -1 if it is not small enough to be worth it.
+int gtfs_delta_encode(const char* before, const char* after, int length, string& out) {
+    out.clear();
+    int limit = length / GTFS_DELTA_RATIO;
+    int pos = 0;
+    while (pos < length) {
+        int start = pos + (int)gtfs_first_diff(before + pos, after + pos, (size_t)(length - pos));
+        if (start == length) {
+            break;
+        }
+        int end = start + 1;
+        for (;;) {
+            while (end < length && before[end] != after[end]) {
+                end++;
+            }
+            int gap = end;
+            while (gap < length && gap - end < 8 && before[gap] == after[gap]) {
+                gap++;
+            }
+            if (gap < length && gap - end < 8) {
+                end = gap;
+                continue;
+            }
+            break;
+        }
+        gtfs_delta_put_run(out, (unsigned int)(start - pos), after + start, (unsigned int)(end - start));
+        if ((int)out.size() > limit) {
+            return -1;
+        }
+        pos = end;
+    }
+    return (int)out.size();
+}
+
+static int delta_apply(const log_record_t& rec, char* dst) {
+    if (rec.length > INT32_MAX) {
+        return -1;
+    }
+    const unsigned char* p = (const unsigned char*)rec.payload;
+    const unsigned char* end = p + rec.stored_length;
+    unsigned int pos = 0;
+    while (p < end) {
+        unsigned int skip, len;
+        if (!delta_get_varint(p, end, skip) || !delta_get_varint(p, end, len)) {
+            return -1;
+        }
+        if (skip > (unsigned int)rec.length - pos || len > (unsigned int)rec.length - pos - skip ||
+            len > (unsigned int)(end - p)) {
+            return -1;
+        }
+        pos += skip;
+        memcpy(dst + pos, p, len);
+        p += len;
+        pos += len;
+    }
+    return 0;
+}
+
+int gtfs_log_decode(const log_record_t& rec, const string& dict, char* dst) {
+    switch (rec.encoding) {
+    case GTFS_ENC_RAW:
+        memcpy(dst, rec.payload, (size_t)rec.length);
+        return 0;
+    case GTFS_ENC_LZ:
+        if (rec.length > INT32_MAX || rec.stored_length > INT32_MAX) {
+            return -1;
+        }
+        if (rec.dict_id != 0 && rec.dict_id != gtfs_dict_id(dict.data(), (int)dict.size())) {
+            ERROR_PRINT("dictionary mismatch for " << rec.filename << "\n");
+            return -1;
+        }
+        return gtfs_lz_decompress(dict.data(), rec.dict_id ? (int)dict.size() : 0,
+                                  rec.payload, (int)rec.stored_length, dst, (int)rec.length);
+    case GTFS_ENC_DELTA:
+        return delta_apply(rec, dst);
+    default:
+        ERROR_PRINT("unknown record encoding " << rec.encoding << "\n");
+        return -1;
+    }
+}
+
+// The records of one file, in log order, starting after its last tombstone.
+vector<log_record_t> gtfs_log_select(const vector<log_record_t>& records, const string& filename) {
+    vector<log_record_t> selected;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (records[i].filename != filename) {
+            continue;
+        }
+        if (records[i].encoding == GTFS_ENC_REMOVE) {
+            selected.clear();
+        } else {
+            selected.push_back(records[i]);
+        }
+    }
+    return selected;
+}
+
+// Applies one file's records to its mapping. base_path locates the file's
+// dictionary. A record that straddles two windows is decoded into a copy of
+// the bytes it covers, since a delta only rewrites the changed runs. Stops
+// and returns -1 at the first record that cannot be applied; the caller must
+// then keep the log.
+int gtfs_log_apply(const vector<log_record_t>& records, window_map_t* wm, string base_path) {
+    string dict;
+    bool dict_loaded = false;
+    for (size_t i = 0; i < records.size(); i++) {
+        const log_record_t& rec = records[i];
+        if (rec.offset + rec.length > wm->size) {
+            ERROR_PRINT("record beyond end of " << base_path << "\n");
+            return -1;
+        }
+        if (rec.length == 0) {
+            continue;
+        }
+        if (rec.dict_id != 0 && !dict_loaded) {
+            gtfs_dict_load(base_path, dict);
+            dict_loaded = true;
+        }
+        size_t avail = 0;
+        char* dst = gtfs_window_at(wm, rec.offset, &avail);
+        int ret;
+        if (dst != NULL && avail >= (size_t)rec.length) {
+            ret = gtfs_log_decode(rec, dict, dst);
+        } else {
+            string span((size_t)rec.length, '\0');
+            ret = gtfs_window_read(wm, rec.offset, span.size(), &span[0]) == 0 &&
+                  gtfs_log_decode(rec, dict, &span[0]) == 0 &&
+                  gtfs_window_write(wm, rec.offset, span.size(), span.data()) == 0 ? 0 : -1;
+        }
+        if (ret != 0) {
+            ERROR_PRINT("cannot apply record at " << rec.offset << " of " << base_path << "\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int gtfs_dict_load(string base_path, string& dict) {
+    return gtfs_io_read_file(base_path + ".dict", dict);
+}
+
+// The first process to publish a dictionary wins; link() fails with EEXIST
+// for everyone else, who then load the published one. Records name the
+// dictionary they need, so its directory entry is synced before anyone
+// compresses against it.
+int gtfs_dict_create(string base_path, const char* data, int length, string& dict) {
+    string dict_path = base_path + ".dict";
+    string tmp_path = dict_path + ".tmp." + to_string(getpid());
+    size_t slash = base_path.rfind('/');
+    string dir = slash == string::npos ? "." : base_path.substr(0, slash);
+    int len = length < GTFS_DICT_SIZE ? length : GTFS_DICT_SIZE;
+
+    int fd = gtfs_io()->open(tmp_path.c_str(), O_CREAT|O_WRONLY|O_TRUNC, S_IRWXU);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = gtfs_io()->write(fd, data, (size_t)len);
+    int synced = gtfs_io()->fdatasync(fd);
+    gtfs_io()->close(fd);
+    int ret = (n == len && synced == 0) ? gtfs_io()->link(tmp_path.c_str(), dict_path.c_str()) : -1;
+    gtfs_io()->unlink(tmp_path.c_str());
+
+    if (ret == 0) {
+        dict.assign(data, (size_t)len);
+    } else if (gtfs_dict_load(base_path, dict) != 0) {
+        dict.clear();
+        return -1;
+    }
+    int dfd = gtfs_io()->open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (dfd < 0 || gtfs_io()->fsync(dfd) != 0) {
+        ERROR_PRINT("cannot sync the directory of " << dict_path << "\n");
+        if (dfd >= 0) {
+            gtfs_io()->close(dfd);
+        }
+        dict.clear();
+        return -1;
+    }
+    gtfs_io()->close(dfd);
+    return 0;
+}
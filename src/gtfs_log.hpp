@@ -0,0 +1,55 @@
+#ifndef GTFS_REDO_LOG
+#define GTFS_REDO_LOG
+
+#include "gtfs_window.hpp"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// GTFileSystem redo log records, appended to the directory's write-ahead log
+//
+// <filename>\n<length>\n<offset>\n<encoding> <stored_length> <dict_id> <crc>\n<payload>\n @@@###$$$ \n
+//
+// The payload is stored_length raw bytes, so it may hold binary data. A record
+// is only valid if its terminator is present and its CRC32C (over the header
+// fields and the stored payload) matches; a torn or corrupt tail is ignored.
+// Lengths and offsets are decimal and 64-bit.
+
+#define GTFS_LOG_TERMINATOR " @@@###$$$ "
+
+#define GTFS_ENC_RAW 0
+#define GTFS_ENC_LZ  1
+#define GTFS_ENC_DELTA 2   // changed runs against the write's before-image
+#define GTFS_ENC_REMOVE 3  // tombstone: the file's earlier records are void
+
+// A delta record is only used when it is at most 1/GTFS_DELTA_RATIO of the full image.
+#define GTFS_DELTA_RATIO 4
+
+#define GTFS_DICT_SIZE 4096
+
+typedef struct log_record {
+    std::string filename;
+    int64_t length;
+    int64_t offset;
+    int encoding;
+    unsigned int dict_id;
+    const char* payload;
+    int64_t stored_length;
+    unsigned int crc;
+} log_record_t;
+
+unsigned int gtfs_log_checksum(const log_record_t& rec);
+void gtfs_log_encode(std::string& out, const log_record_t& rec);
+
+size_t gtfs_log_scan(const char* buf, size_t len, std::vector<log_record_t>& records);
+int gtfs_log_decode(const log_record_t& rec, const std::string& dict, char* dst);
+int gtfs_delta_encode(const char* before, const char* after, int length, std::string& out);
+void gtfs_delta_put_run(std::string& out, unsigned int skip, const char* data, unsigned int len);
+std::vector<log_record_t> gtfs_log_select(const std::vector<log_record_t>& records, const std::string& filename);
+int gtfs_log_apply(const std::vector<log_record_t>& records, window_map_t* wm, std::string base_path);
+
+int gtfs_dict_load(std::string base_path, std::string& dict);
+int gtfs_dict_create(std::string base_path, const char* data, int length, std::string& dict);
+
+#endif
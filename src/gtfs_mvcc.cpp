@@ -0,0 +1,102 @@
+#include "gtfs_mvcc.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_window.hpp"
+
+#include <string.h>
+
+using namespace std;
+
+mvcc_t* gtfs_mvcc_create() {
+    mvcc_t* mv = new mvcc_t();
+    mv->committed = 0;
+    return mv;
+}
+
+void gtfs_mvcc_destroy(mvcc_t* mv) {
+    if (mv == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < mv->versions.size(); i++) {
+        delete mv->versions[i];
+    }
+    delete mv;
+}
+
+// Frees the versions no registered reader can need. Caller holds mv->lock.
+static void mvcc_collect(mvcc_t* mv) {
+    uint64_t oldest = mv->readers.empty() ? mv->committed.load() : *mv->readers.begin();
+    while (!mv->versions.empty() && mv->versions.front()->seq <= oldest) {
+        delete mv->versions.front();
+        mv->versions.pop_front();
+    }
+}
+
+int gtfs_mvcc_read(mvcc_t* mv, window_map_t* map, off_t offset, size_t length, char* dst) {
+    uint64_t snapshot;
+    {
+        lock_guard<mutex> guard(mv->lock);
+        snapshot = mv->committed.load(memory_order_acquire);
+        mv->readers.insert(snapshot);
+    }
+    int ret = gtfs_window_read(map, offset, length, dst);
+
+    lock_guard<mutex> guard(mv->lock);
+    off_t end = offset + (off_t)length;
+    for (size_t i = mv->versions.size(); i > 0 && ret == 0; i--) {
+        const mvcc_version_t* v = mv->versions[i - 1];
+        if (v->seq <= snapshot) {
+            break;
+        }
+        const char* before = v->before.data();
+        for (size_t j = 0; j < v->extents.size(); j++) {
+            off_t from = v->extents[j].first;
+            off_t to = from + (off_t)v->extents[j].second;
+            if (from < end && offset < to) {
+                off_t lo = from > offset ? from : offset;
+                off_t hi = to < end ? to : end;
+                memcpy(dst + (lo - offset), before + (lo - from), (size_t)(hi - lo));
+            }
+            before += v->extents[j].second;
+        }
+    }
+    mv->readers.erase(mv->readers.find(snapshot));
+    return ret;
+}
+
+// Copies a synced write into the mapping as the next version.
+int gtfs_mvcc_install(mvcc_t* mv, window_map_t* map, write_t* write_id) {
+    mvcc_version_t* v = new mvcc_version_t();
+    v->extents = write_id->extents;
+    if (v->extents.empty()) {
+        v->extents.push_back(make_pair(write_id->offset, write_id->length));
+    }
+    for (size_t i = 0; i < v->extents.size(); i++) {
+        size_t pos = v->before.size();
+        v->before.resize(pos + v->extents[i].second);
+        if (gtfs_window_read(map, v->extents[i].first, v->extents[i].second, &v->before[pos]) != 0) {
+            delete v;
+            return -1;
+        }
+    }
+    {
+        lock_guard<mutex> guard(mv->lock);
+        v->seq = mv->committed.load() + 1;
+        mv->versions.push_back(v);
+    }
+    int ret = 0;
+    const char* data = write_id->data;
+    for (size_t i = 0; i < v->extents.size(); i++) {
+        if (gtfs_window_write(map, v->extents[i].first, v->extents[i].second, data) != 0) {
+            ret = -1;
+        }
+        data += v->extents[i].second;
+    }
+
+    uint64_t seq = v->seq;
+    lock_guard<mutex> guard(mv->lock);
+    mv->committed.store(seq, memory_order_release);
+    mvcc_collect(mv);
+    DEBUG_PRINT(do_verbose, "committed version " << seq << " of " << write_id->filename << ", "
+                << mv->versions.size() << " kept for readers\n");
+    return ret;
+}
@@ -0,0 +1,53 @@
+#ifndef GTFS_MVCC
+#define GTFS_MVCC
+
+#include "gtfs.hpp"
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <set>
+
+// Multi-version reads for files opened with GTFS_OPEN_MVCC. A pending write
+// stays in its write_t and only reaches the mapping when it is synced, so the
+// mapping never holds uncommitted bytes.
+//
+// Each commit gets the next sequence number and leaves an undo version with
+// the bytes it overwrote. The version is registered before the commit copies
+// its data in, and the sequence number is published after. A reader takes
+// the published number as its snapshot, copies from the mapping without any
+// lock, then puts back the before-images of every version newer than its
+// snapshot, newest first. Whatever a concurrent commit had copied so far is
+// undone, so the reader sees the file exactly as of its snapshot and never
+// waits for a writer.
+//
+// Readers register their snapshot while they copy. A version is only needed
+// by readers whose snapshot predates it, so versions at or below the oldest
+// registered snapshot are freed after each commit.
+//
+// Commits to one file must come from one thread at a time, as without MVCC.
+// The guarantee holds between threads of a process; other processes see a
+// commit once it has been checkpointed.
+
+typedef struct mvcc_version {
+    uint64_t seq;
+    std::vector<std::pair<off_t, size_t> > extents;
+    std::string before;    // overwritten bytes, extents back to back
+} mvcc_version_t;
+
+typedef struct mvcc {
+    std::atomic<uint64_t> committed;   // sequence number of the last commit
+    std::deque<mvcc_version_t*> versions;   // oldest first
+    std::multiset<uint64_t> readers;   // snapshots being read
+    std::mutex lock;                   // versions and readers
+} mvcc_t;
+
+mvcc_t* gtfs_mvcc_create();
+void gtfs_mvcc_destroy(mvcc_t* mv);
+
+// Reads through map, the mapping mv's versions belong to.
+int gtfs_mvcc_read(mvcc_t* mv, struct window_map* map, off_t offset, size_t length, char* dst);
+int gtfs_mvcc_install(mvcc_t* mv, struct window_map* map, write_t* write_id);
+
+#endif
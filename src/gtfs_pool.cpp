@@ -0,0 +1,316 @@
+#include "gtfs_pool.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_io.hpp"
+#include "gtfs_wal.hpp"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+static const size_t pool_none = (size_t)-1;
+
+pool_t* gtfs_pool_create(size_t bytes) {
+    size_t count = bytes / GTFS_POOL_PAGE_SIZE;
+    if (count == 0) {
+        return NULL;
+    }
+    void* mem = NULL;
+    if (posix_memalign(&mem, 4096, count * GTFS_POOL_PAGE_SIZE) != 0) {
+        return NULL;
+    }
+    pool_t* pool = new pool_t();
+    pool->mem = (char*)mem;
+    pool->frames.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        pool->frames[i].fl = NULL;
+    }
+    pool->hand = 0;
+    return pool;
+}
+
+static char* pool_data(pool_t* pool, size_t frame) {
+    return pool->mem + frame * GTFS_POOL_PAGE_SIZE;
+}
+
+static void pool_release(pool_t* pool, size_t frame) {
+    pool_frame_t& f = pool->frames[frame];
+    pool->index.erase(make_pair(f.fl, f.page));
+    f.fl = NULL;
+}
+
+// CLOCK: a referenced frame gets a second chance, pinned and dirty ones are
+// skipped. Two sweeps clear every reference bit, so failing means no frame
+// can be evicted.
+static size_t pool_victim(pool_t* pool) {
+    size_t n = pool->frames.size();
+    for (size_t i = 0; i < 2 * n; i++) {
+        size_t frame = pool->hand;
+        pool->hand = (pool->hand + 1) % n;
+        pool_frame_t& f = pool->frames[frame];
+        if (f.fl == NULL) {
+            return frame;
+        }
+        if (f.pins > 0 || f.dirty) {
+            continue;
+        }
+        if (f.ref) {
+            f.ref = false;
+            continue;
+        }
+        pool_release(pool, frame);
+        return frame;
+    }
+    return pool_none;
+}
+
+static void pool_clear_dirty(pool_t* pool) {
+    for (size_t i = 0; i < pool->frames.size(); i++) {
+        pool->frames[i].dirty = false;
+    }
+}
+
+static size_t pool_claim(gtfs_t* gtfs, pool_t* pool, file_t* fl, long page) {
+    size_t frame = pool_victim(pool);
+    if (frame == pool_none) {
+        bool dirty = false;
+        for (size_t i = 0; i < pool->frames.size(); i++) {
+            dirty = dirty || pool->frames[i].dirty;
+        }
+        // Synced bytes are only in the log; once it is checkpointed the base
+        // file holds them and their frames can go.
+        if (dirty && gtfs_wal_checkpoint(gtfs) == 0) {
+            DEBUG_PRINT(do_verbose, "buffer pool full of dirty pages, checkpointed the log\n");
+            pool_clear_dirty(pool);
+            frame = pool_victim(pool);
+        }
+        if (frame == pool_none) {
+            return pool_none;
+        }
+    }
+    pool_frame_t& f = pool->frames[frame];
+    f.fl = fl;
+    f.page = page;
+    f.pins = 0;
+    f.ref = false;
+    f.dirty = false;
+    pool->index[make_pair(fl, page)] = frame;
+    return frame;
+}
+
+// Fills buf from the base file; the part past its end reads as zeros.
+static int pool_fill(file_t* fl, long page, char* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = gtfs_io()->pread(fl->fd, buf + done, len - done, (off_t)page * GTFS_POOL_PAGE_SIZE + (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            memset(buf + done, 0, len - done);
+            break;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+// The frame holding page, read in on a miss.
+static size_t pool_get(gtfs_t* gtfs, pool_t* pool, file_t* fl, long page) {
+    map<pair<file_t*, long>, size_t>::iterator it = pool->index.find(make_pair(fl, page));
+    if (it != pool->index.end()) {
+        pool->frames[it->second].ref = true;
+        return it->second;
+    }
+    size_t frame = pool_claim(gtfs, pool, fl, page);
+    if (frame == pool_none) {
+        ERROR_PRINT("buffer pool exhausted: every frame is pinned\n");
+        return pool_none;
+    }
+    if (pool_fill(fl, page, pool_data(pool, frame), GTFS_POOL_PAGE_SIZE) != 0) {
+        ERROR_PRINT("cannot read " << fl->path << "\n");
+        pool_release(pool, frame);
+        return pool_none;
+    }
+    pool->frames[frame].ref = true;
+    return frame;
+}
+
+// Reads count pages from `page` on that are not resident, each run of them
+// with one preadv. Stops early when no frame can be evicted without a
+// checkpoint. Prefetched frames are unreferenced so unused ones go first.
+static void pool_readahead(pool_t* pool, file_t* fl, long page, long count) {
+    long end = min(page + count, (fl->file_length - 1) / GTFS_POOL_PAGE_SIZE + 1);
+    size_t fetched = 0;
+    for (long p = page; p < end; ) {
+        if (pool->index.count(make_pair(fl, p))) {
+            p++;
+            continue;
+        }
+        long from = p;
+        vector<size_t> frames;
+        vector<struct iovec> iov;
+        for (; p < end && !pool->index.count(make_pair(fl, p)); p++) {
+            size_t frame = pool_victim(pool);
+            if (frame == pool_none) {
+                break;
+            }
+            pool_frame_t& f = pool->frames[frame];
+            f.fl = fl;
+            f.page = p;
+            f.pins = 0;
+            f.ref = false;
+            f.dirty = false;
+            pool->index[make_pair(fl, p)] = frame;
+            struct iovec v = {pool_data(pool, frame), GTFS_POOL_PAGE_SIZE};
+            iov.push_back(v);
+            frames.push_back(frame);
+        }
+        if (frames.empty()) {
+            break;
+        }
+        ssize_t n = gtfs_io()->preadv(fl->fd, &iov[0], (int)iov.size(), (off_t)from * GTFS_POOL_PAGE_SIZE);
+        size_t got = n > 0 ? (size_t)n : 0;
+        for (size_t i = 0; i < frames.size(); i++) {
+            size_t start = i * GTFS_POOL_PAGE_SIZE;
+            if (n < 0) {
+                pool_release(pool, frames[i]);
+            } else if (got < start + GTFS_POOL_PAGE_SIZE &&
+                       pool_fill(fl, from + (long)i, pool_data(pool, frames[i]), GTFS_POOL_PAGE_SIZE) != 0) {
+                pool_release(pool, frames[i]);
+            } else {
+                fetched++;
+            }
+        }
+    }
+    if (fetched > 0) {
+        DEBUG_PRINT(do_verbose, "read ahead " << fetched << " pages of " << fl->filename << "\n");
+    }
+}
+
+int gtfs_pool_read(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length, char* dst) {
+    pool_t* pool = gtfs->pool;
+    if (offset < 0 || length > (size_t)fl->file_length || offset > fl->file_length - (off_t)length) {
+        ERROR_PRINT("read beyond end of " << fl->filename << "\n");
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    lock_guard<mutex> guard(pool->lock);
+    if (fl->fd < 0) {
+        ERROR_PRINT(fl->filename << " is closed\n");
+        return -1;
+    }
+    long first = offset / GTFS_POOL_PAGE_SIZE;
+    long last = (offset + (off_t)length - 1) / GTFS_POOL_PAGE_SIZE;
+    for (long page = first; page <= last; page++) {
+        size_t frame = pool_get(gtfs, pool, fl, page);
+        if (frame == pool_none) {
+            return -1;
+        }
+        long start = page == first ? offset % GTFS_POOL_PAGE_SIZE : 0;
+        long end = page == last ? (offset + (off_t)length - 1) % GTFS_POOL_PAGE_SIZE + 1 : GTFS_POOL_PAGE_SIZE;
+        memcpy(dst, pool_data(pool, frame) + start, (size_t)(end - start));
+        dst += end - start;
+    }
+    return 0;
+}
+
+void gtfs_pool_prefetch(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length) {
+    pool_t* pool = gtfs->pool;
+    if (length == 0 || offset < 0 || offset >= fl->file_length) {
+        return;
+    }
+    lock_guard<mutex> guard(pool->lock);
+    if (fl->fd < 0) {
+        return;
+    }
+    long first = offset / GTFS_POOL_PAGE_SIZE;
+    long count = (offset + (off_t)length - 1) / GTFS_POOL_PAGE_SIZE - first + 1;
+    // A quarter of the pool at most, so readahead cannot flush what readers use.
+    pool_readahead(pool, fl, first, min(count, max(1L, (long)pool->frames.size() / 4)));
+}
+
+// Copies src into the pool, adds pins to every page it touches and marks them
+// dirty if asked. All pages are brought in before anything is copied, so a
+// failure leaves the pool unchanged.
+int gtfs_pool_write(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length, const char* src, int pins, bool dirty) {
+    pool_t* pool = gtfs->pool;
+    if (offset < 0 || length > (size_t)fl->file_length || offset > fl->file_length - (off_t)length) {
+        ERROR_PRINT("write beyond end of " << fl->filename << "\n");
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    lock_guard<mutex> guard(pool->lock);
+    if (fl->fd < 0) {
+        ERROR_PRINT(fl->filename << " is closed\n");
+        return -1;
+    }
+    long first = offset / GTFS_POOL_PAGE_SIZE;
+    long last = (offset + (off_t)length - 1) / GTFS_POOL_PAGE_SIZE;
+    if ((size_t)(last - first + 1) > pool->frames.size()) {
+        ERROR_PRINT("write of " << length << " bytes does not fit in the buffer pool\n");
+        return -1;
+    }
+    vector<size_t> frames;
+    for (long page = first; page <= last; page++) {
+        size_t frame = pool_get(gtfs, pool, fl, page);
+        if (frame == pool_none) {
+            for (size_t i = 0; i < frames.size(); i++) {
+                pool->frames[frames[i]].pins--;
+            }
+            return -1;
+        }
+        pool->frames[frame].pins++;
+        frames.push_back(frame);
+    }
+    for (long page = first; page <= last; page++) {
+        pool_frame_t& f = pool->frames[frames[(size_t)(page - first)]];
+        long start = page == first ? offset % GTFS_POOL_PAGE_SIZE : 0;
+        long end = page == last ? (offset + (off_t)length - 1) % GTFS_POOL_PAGE_SIZE + 1 : GTFS_POOL_PAGE_SIZE;
+        memcpy(pool_data(pool, frames[(size_t)(page - first)]) + start, src, (size_t)(end - start));
+        src += end - start;
+        f.pins += pins - 1;
+        if (f.pins < 0) {
+            f.pins = 0;
+        }
+        f.dirty = f.dirty || dirty;
+    }
+    return 0;
+}
+
+void gtfs_pool_drop(gtfs_t* gtfs, file_t* fl) {
+    pool_t* pool = gtfs->pool;
+    if (pool == NULL) {
+        return;
+    }
+    lock_guard<mutex> guard(pool->lock);
+    for (size_t i = 0; i < pool->frames.size(); i++) {
+        if (pool->frames[i].fl == fl) {
+            pool_release(pool, i);
+        }
+    }
+}
+
+// Checkpoints under the pool lock, so a sync that commits after the
+// checkpoint cannot have its pages marked clean by it.
+int gtfs_pool_checkpoint(gtfs_t* gtfs) {
+    pool_t* pool = gtfs->pool;
+    lock_guard<mutex> guard(pool->lock);
+    int ret = gtfs_wal_checkpoint(gtfs);
+    if (ret == 0) {
+        pool_clear_dirty(pool);
+    }
+    return ret;
+}
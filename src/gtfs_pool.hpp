@@ -0,0 +1,55 @@
+#ifndef GTFS_POOL
+#define GTFS_POOL
+
+#include "gtfs.hpp"
+
+#include <stddef.h>
+#include <map>
+#include <mutex>
+
+// Buffer pool for files opened with GTFS_OPEN_POOLED. Instead of mapping the
+// whole file, pages are read with pread into a fixed set of frames shared by
+// all pooled files of a GTFileSystem, so memory use is bounded by the pool
+// size however large the files are.
+//
+// Frames are never written back: the base file only changes through the log.
+// A frame holding bytes of a pending write is pinned until the write is
+// synced or aborted, and the file cannot be closed or removed before then; a
+// frame holding synced bytes is dirty until the next checkpoint puts them into
+// the base file. Eviction is CLOCK over the frames that are neither. When
+// every frame is dirty or pinned the pool checkpoints the log itself to free
+// the dirty ones.
+//
+// Readahead (see gtfs_readahead.hpp) brings pages in with one preadv per run
+// of pages that are not resident.
+
+#define GTFS_POOL_PAGE_SIZE (64 << 10)
+#define GTFS_POOL_DEFAULT_SIZE (64 << 20)
+
+typedef struct pool_frame {
+    file_t* fl;          // NULL while the frame is free
+    long page;
+    int pins;
+    bool ref;            // CLOCK reference bit
+    bool dirty;
+} pool_frame_t;
+
+typedef struct pool {
+    char* mem;
+    std::vector<pool_frame_t> frames;
+    std::map<std::pair<file_t*, long>, size_t> index;   // (file, page) -> frame
+    size_t hand;
+    std::mutex lock;
+} pool_t;
+
+pool_t* gtfs_pool_create(size_t bytes);
+
+int gtfs_pool_read(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length, char* dst);
+int gtfs_pool_write(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length, const char* src, int pins, bool dirty);
+void gtfs_pool_prefetch(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length);
+// Releases the frames of a closed fl. With its fd at -1 the pool brings none
+// of its pages back.
+void gtfs_pool_drop(gtfs_t* gtfs, file_t* fl);
+int gtfs_pool_checkpoint(gtfs_t* gtfs);
+
+#endif
@@ -0,0 +1,103 @@
+#include "gtfs_quota.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_catalog.hpp"
+#include "gtfs_wal.hpp"
+#include "gtfs_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+extern int do_verbose;
+
+static double quota_seconds(const struct timespec& from, const struct timespec& to) {
+    return (double)(to.tv_sec - from.tv_sec) + (double)(to.tv_nsec - from.tv_nsec) / 1e9;
+}
+
+// How full the fuller budget would be with bytes more logged.
+static double quota_fill(const quota_t* q, uint64_t total, uint64_t largest, size_t bytes) {
+    double fill = 0;
+    if (q->log_budget > 0) {
+        fill = (double)(total + bytes) / (double)q->log_budget;
+    }
+    if (q->file_budget > 0) {
+        fill = max(fill, (double)(largest + bytes) / (double)q->file_budget);
+    }
+    return fill;
+}
+
+// Pacing rate at fill: what the last checkpoint drained at the soft mark,
+// GTFS_QUOTA_MIN_RATE at the budget.
+static double quota_rate(const quota_t* q, double fill) {
+    double soft = GTFS_QUOTA_SOFT_PCT / 100.0;
+    double drain = max(q->rate, GTFS_QUOTA_MIN_RATE);
+    if (fill >= 1) {
+        return GTFS_QUOTA_MIN_RATE;
+    }
+    return GTFS_QUOTA_MIN_RATE + (drain - GTFS_QUOTA_MIN_RATE) * (1 - fill) / (1 - soft);
+}
+
+void gtfs_quota_admit(gtfs_t* gtfs, size_t bytes, const vector<string>& files) {
+    quota_t* q = gtfs->quota;
+    if (q == NULL) {
+        return;
+    }
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool stalled = false;
+    unique_lock<mutex> guard(q->lock);
+    for (;;) {
+        uint64_t total, largest;
+        gtfs_catalog_backlog(gtfs, files, total, largest);
+        double fill = quota_fill(q, total, largest, bytes);
+        if (total == 0 || fill * 100 < GTFS_QUOTA_SOFT_PCT) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!q->checkpointing && quota_seconds(q->failed, now) * 1000 >= GTFS_QUOTA_RETRY_MS) {
+            q->checkpointing = true;
+            stalled = true;
+            guard.unlock();
+            int ret = gtfs->pool ? gtfs_pool_checkpoint(gtfs) : gtfs_wal_checkpoint(gtfs);
+            struct timespec done;
+            clock_gettime(CLOCK_MONOTONIC, &done);
+            guard.lock();
+            q->checkpointing = false;
+            q->stats.checkpoints++;
+            if (ret == 0 && quota_seconds(now, done) > 0) {
+                q->rate = (double)total / quota_seconds(now, done);
+            } else if (ret != 0) {
+                q->failed = done;
+            }
+            DEBUG_PRINT(do_verbose, "checkpointed a log backlog of " << total << " bytes, "
+                        << (ret == 0 ? "drained at " + to_string((uint64_t)q->rate) + " bytes/s" : "failed") << "\n");
+            q->cv.notify_all();
+            continue;
+        }
+        if (fill >= 1 && q->checkpointing) {
+            stalled = true;
+            q->cv.wait(guard);
+            continue;
+        }
+        // Paced: a commit may take its bytes once the bucket holds them or,
+        // if they are more than a burst, a full burst.
+        double rate = quota_rate(q, fill);
+        double need = min((double)bytes, GTFS_QUOTA_BURST);
+        q->tokens = min(GTFS_QUOTA_BURST, q->tokens + quota_seconds(q->refilled, now) * rate);
+        q->refilled = now;
+        if (q->tokens >= need) {
+            q->tokens -= (double)bytes;
+            break;
+        }
+        stalled = true;
+        q->cv.wait_for(guard, chrono::microseconds((long)((need - q->tokens) / rate * 1e6) + 1));
+    }
+    if (stalled) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t ns = (uint64_t)(quota_seconds(start, now) * 1e9);
+        q->stats.stalls++;
+        q->stats.stall_ns += ns;
+        q->stats.max_stall_ns = max(q->stats.max_stall_ns, ns);
+    }
+}
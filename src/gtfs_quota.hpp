@@ -0,0 +1,49 @@
+#ifndef GTFS_QUOTA
+#define GTFS_QUOTA
+
+#include "gtfs.hpp"
+
+#include <stdint.h>
+#include <time.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Log budget set by gtfs_set_log_budget: a bound on the bytes the log holds
+// for all files together and for any one file. The bytes are counted in the
+// catalog, so every process sharing the directory sees the same backlog, and
+// a checkpoint resets them. Recovery replays at most a budget of records.
+//
+// A commit that would take the log past GTFS_QUOTA_SOFT_PCT percent of a
+// budget checkpoints it first. The checkpoint goes ahead of that commit and
+// of the commits queued behind it for the log lock. One commit per process
+// checkpoints at a time. The others are paced by a token bucket instead of
+// refused: its rate falls from what the last checkpoint drained to
+// GTFS_QUOTA_MIN_RATE as the backlog nears the budget. Past the budget they
+// wait for the checkpoint to end. If a checkpoint fails, the next attempt is
+// GTFS_QUOTA_RETRY_MS later, and commits keep being paced until then.
+
+#define GTFS_QUOTA_SOFT_PCT 50
+#define GTFS_QUOTA_MIN_RATE ((double)(1 << 20))     // bytes/s
+#define GTFS_QUOTA_BURST ((double)(256 << 10))      // bytes a paced commit may take at once
+#define GTFS_QUOTA_RETRY_MS 100
+
+typedef struct quota {
+    size_t log_budget;       // 0 for no bound
+    size_t file_budget;
+    double rate;             // bytes/s the last checkpoint drained, 0 before one
+    double tokens;
+    struct timespec refilled;
+    struct timespec failed;  // of the last checkpoint that failed
+    bool checkpointing;      // a commit of this process is checkpointing
+    gtfs_log_stats_t stats;
+    std::mutex lock;
+    std::condition_variable cv;
+} quota_t;
+
+// Called before bytes of records for files are committed; returns once the
+// log has room for them.
+void gtfs_quota_admit(gtfs_t* gtfs, size_t bytes, const std::vector<std::string>& files);
+
+#endif
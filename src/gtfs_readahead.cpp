@@ -0,0 +1,85 @@
+#include "gtfs_readahead.hpp"
+#include "gtfs_trace.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+extern int do_verbose;
+
+// Most records a strided window fetches, to bound the ranges per read.
+#define RA_MAX_RECORDS 256
+
+static size_t ra_grow(size_t window) {
+    return window == 0 ? GTFS_RA_MIN : min(2 * window, GTFS_RA_MAX);
+}
+
+static void ra_sequential(readahead_t* ra, off_t file_length, vector<pair<off_t, size_t> >& ranges) {
+    if (ra->ahead < ra->end) {
+        ra->ahead = ra->end;
+    }
+    if (ra->window != 0 && ra->ahead - ra->end > (off_t)(ra->window / 2)) {
+        return;
+    }
+    ra->window = ra_grow(ra->window);
+    off_t to = min(file_length, ra->end + (off_t)ra->window);
+    if (to > ra->ahead) {
+        ranges.push_back(make_pair(ra->ahead, (size_t)(to - ra->ahead)));
+        ra->fetched += (size_t)(to - ra->ahead);
+        ra->ahead = to;
+    }
+}
+
+static void ra_strided(readahead_t* ra, size_t length, off_t file_length, vector<pair<off_t, size_t> >& ranges) {
+    off_t next = ra->start + ra->stride;
+    if (ra->ahead < next) {
+        ra->ahead = next;
+    }
+    size_t records = max((size_t)1, min(ra->window / length, (size_t)RA_MAX_RECORDS));
+    if (ra->window != 0 && (size_t)((ra->ahead - next) / ra->stride) > records / 2) {
+        return;
+    }
+    ra->window = ra_grow(ra->window);
+    records = max((size_t)1, min(ra->window / length, (size_t)RA_MAX_RECORDS));
+    off_t to = next + (off_t)records * ra->stride;
+    for (; ra->ahead < to && ra->ahead < file_length; ra->ahead += ra->stride) {
+        size_t n = (size_t)min((off_t)length, file_length - ra->ahead);
+        ranges.push_back(make_pair(ra->ahead, n));
+        ra->fetched += n;
+    }
+}
+
+void gtfs_readahead_note(readahead_t* ra, off_t offset, size_t length, off_t file_length,
+                         vector<pair<off_t, size_t> >& ranges) {
+    if (length == 0) {
+        return;
+    }
+    lock_guard<mutex> guard(ra->lock);
+    off_t stride = offset - ra->start;
+    bool sequential = offset == ra->end;
+    bool strided = !sequential && stride > (off_t)length && stride == ra->stride;
+    if ((sequential || strided) && (ra->run == 0 || strided == ra->strided)) {
+        ra->run++;
+    } else {
+        ra->run = sequential || strided ? 1 : 0;
+        ra->window = 0;
+        ra->ahead = 0;
+    }
+    ra->strided = strided;
+    ra->stride = stride;
+    ra->start = offset;
+    ra->end = offset + (off_t)length;
+    if (ra->run < GTFS_RA_TRIGGER) {
+        return;
+    }
+    size_t before = ranges.size();
+    if (strided) {
+        ra_strided(ra, length, file_length, ranges);
+    } else {
+        ra_sequential(ra, file_length, ranges);
+    }
+    if (ranges.size() > before) {
+        DEBUG_PRINT(do_verbose, (strided ? "strided" : "sequential") << " reader, fetching " << ranges.size() - before
+                    << " ranges ahead with a " << ra->window << " byte window\n");
+    }
+}
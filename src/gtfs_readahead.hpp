@@ -0,0 +1,44 @@
+#ifndef GTFS_READAHEAD
+#define GTFS_READAHEAD
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Access-pattern detection for gtfs_read_file. Every file remembers where its
+// last read started and ended. A read starting where the previous one ended
+// is sequential; one starting the same distance past the previous start as
+// that one did past its predecessor is strided. After GTFS_RA_TRIGGER such
+// reads in a row the file is a stream, and the bytes its next reads will
+// touch are fetched ahead of them: by the kernel (MADV_WILLNEED) for mapped
+// files, into the buffer pool for pooled ones.
+//
+// The window starts at GTFS_RA_MIN and doubles every time the reader gets
+// within half a window of what was fetched, up to GTFS_RA_MAX, so the next
+// window is on its way while the reader still works through the current
+// one. A read off the pattern drops the file back to no readahead.
+
+#define GTFS_RA_TRIGGER 2
+#define GTFS_RA_MIN ((size_t)128 << 10)
+#define GTFS_RA_MAX ((size_t)8 << 20)
+
+typedef struct readahead {
+    off_t start;         // of the previous read
+    off_t end;
+    off_t stride;        // distance between the starts of the previous two reads
+    int run;             // reads in a row that kept the pattern
+    size_t window;       // bytes per fetch, 0 while the file is no stream
+    bool strided;        // kind of the current run
+    off_t ahead;         // fetched up to here; strided, the first record not fetched
+    size_t fetched;      // bytes asked for ahead of readers, in total
+    std::mutex lock;
+} readahead_t;
+
+// Records a read of [offset, offset + length) of a file of file_length bytes
+// and appends to ranges what should be fetched ahead of it.
+void gtfs_readahead_note(readahead_t* ra, off_t offset, size_t length, off_t file_length,
+                         std::vector<std::pair<off_t, size_t> >& ranges);
+
+#endif
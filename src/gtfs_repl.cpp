@@ -0,0 +1,421 @@
+#include "gtfs_repl.hpp"
+#include "gtfs_wal.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_io.hpp"
+#include "gtfs_simd.hpp"
+#include "gtfs_pool.hpp"
+#include "gtfs_catalog.hpp"
+#include "gtfs_blocks.hpp"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+static int repl_write_full(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) {
+            n = write(fd, buf, len);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int repl_read_full(int fd, char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static string repl_pack(uint32_t type, uint64_t seq, const string& body) {
+    repl_frame_t hdr;
+    hdr.magic = GTFS_REPL_MAGIC;
+    hdr.type = type;
+    hdr.seq = seq;
+    hdr.length = body.size();
+    hdr.crc = gtfs_crc32c(0, body.data(), body.size());
+    hdr.reserved = 0;
+    string out((const char*)&hdr, sizeof(hdr));
+    out.append(body);
+    return out;
+}
+
+static int repl_recv(int fd, repl_frame_t& hdr, string& body) {
+    if (repl_read_full(fd, (char*)&hdr, sizeof(hdr)) != 0 || hdr.magic != GTFS_REPL_MAGIC) {
+        return -1;
+    }
+    body.resize(hdr.length);
+    if (hdr.length > 0 && repl_read_full(fd, &body[0], hdr.length) != 0) {
+        return -1;
+    }
+    if (gtfs_crc32c(0, body.data(), body.size()) != hdr.crc) {
+        ERROR_PRINT("corrupt replication frame " << hdr.seq << "\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void repl_trim(repl_t* r) {
+    while (!r->backlog.empty() && r->backlog.front().first <= r->acked) {
+        r->backlog_bytes -= r->backlog.front().second.size();
+        r->backlog.pop_front();
+    }
+}
+
+// Sends a RESET and then every file as a checkpoint leaves it. A record
+// committed meanwhile waits for r->lock and is shipped after the catch-up,
+// redoing bytes the follower may already have. Caller holds r->lock.
+static int repl_catch_up(gtfs_t* gtfs, repl_t* r) {
+    if ((gtfs->pool ? gtfs_pool_checkpoint(gtfs) : gtfs_wal_checkpoint(gtfs)) != 0 &&
+        gtfs_io()->access(gtfs_wal_dir(gtfs).c_str(), F_OK) == 0) {
+        ERROR_PRINT("cannot checkpoint " << gtfs->dirname << " to catch the follower up\n");
+        return -1;
+    }
+    r->backlog.clear();
+    r->backlog_bytes = 0;
+    string frame = repl_pack(GTFS_REPL_RESET, r->next_seq++, "");
+    if (repl_write_full(r->fd, frame.data(), frame.size()) != 0) {
+        return -1;
+    }
+    vector<string> files = gtfs_catalog_scan(gtfs->dirname);
+    size_t sent = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        string data;
+        if (gtfs_blocks_restore(gtfs, files[i]) != 0 ||
+            gtfs_io_read_file(gtfs->dirname + "/" + files[i], data) != 0) {
+            ERROR_PRINT("cannot read " << files[i] << " to catch the follower up\n");
+            return -1;
+        }
+        // Base files are one byte longer than the file.
+        size_t length = data.empty() ? 0 : data.size() - 1;
+        size_t offset = 0;
+        do {
+            size_t n = min(GTFS_REPL_CHUNK, length - offset);
+            log_record_t rec;
+            rec.filename = files[i];
+            rec.length = (int64_t)n;
+            rec.offset = (int64_t)offset;
+            rec.encoding = GTFS_ENC_RAW;
+            rec.dict_id = 0;
+            rec.payload = data.data() + offset;
+            rec.stored_length = (int64_t)n;
+            string body;
+            gtfs_log_encode(body, rec);
+            frame = repl_pack(GTFS_REPL_RECORD, r->next_seq++, body);
+            if (repl_write_full(r->fd, frame.data(), frame.size()) != 0) {
+                return -1;
+            }
+            offset += n;
+            sent += n;
+        } while (offset < length);
+    }
+    r->caught_up = r->next_seq - 1;
+    DEBUG_PRINT(do_verbose, "caught the follower up with " << files.size() << " files, " << sent << " bytes\n");
+    return 0;
+}
+
+// Consumes ACK frames until `seq` is acknowledged or timeout_ms expires
+// (0 only drains what is already readable). Caller holds r->lock.
+static int repl_wait_ack(repl_t* r, uint64_t seq, int timeout_ms) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (r->acked < seq && r->fd >= 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        struct pollfd p;
+        p.fd = r->fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        int ready = poll(&p, 1, timeout_ms > elapsed ? (int)(timeout_ms - elapsed) : 0);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            break;
+        }
+
+        repl_frame_t hdr;
+        string body;
+        if (repl_recv(r->fd, hdr, body) != 0) {
+            ERROR_PRINT("follower disconnected\n");
+            r->fd = -1;
+            break;
+        }
+        if (hdr.type == GTFS_REPL_ACK && hdr.seq > r->acked) {
+            r->acked = hdr.seq;
+            repl_trim(r);
+        }
+    }
+    return r->acked >= seq ? 0 : -1;
+}
+
+// Called by gtfs_sync_write_file after the record is in the local log.
+int gtfs_repl_ship(gtfs_t* gtfs, const log_record_t& rec) {
+    repl_t* r = gtfs->repl;
+    if (r == NULL) {
+        return 0;
+    }
+    string body;
+    gtfs_log_encode(body, rec);
+
+    std::lock_guard<std::mutex> guard(r->lock);
+    uint64_t seq = r->next_seq++;
+    string frame = repl_pack(GTFS_REPL_RECORD, seq, body);
+    r->backlog.push_back(make_pair(seq, frame));
+    r->backlog_bytes += frame.size();
+    while (r->backlog_bytes > GTFS_REPL_BACKLOG_MAX && r->backlog.size() > 1) {
+        r->dropped = r->backlog.front().first;
+        r->backlog_bytes -= r->backlog.front().second.size();
+        r->backlog.pop_front();
+    }
+
+    if (r->fd >= 0 && repl_write_full(r->fd, frame.data(), frame.size()) != 0) {
+        ERROR_PRINT("follower disconnected\n");
+        r->fd = -1;
+    }
+    if (r->mode == GTFS_REPL_SYNC) {
+        return repl_wait_ack(r, seq, GTFS_REPL_TIMEOUT_MS);
+    }
+    repl_wait_ack(r, seq, 0);
+    return 0;
+}
+
+int gtfs_repl_attach(gtfs_t* gtfs, int fd, int mode) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Attaching follower to directory " << gtfs->dirname << "\n");
+
+        if (gtfs->repl == NULL) {
+            gtfs->repl = new repl_t();
+            gtfs->repl->fd = -1;
+            gtfs->repl->next_seq = 1;
+            gtfs->repl->acked = 0;
+            gtfs->repl->backlog_bytes = 0;
+            gtfs->repl->dropped = 0;
+            gtfs->repl->caught_up = 0;
+        }
+        repl_t* r = gtfs->repl;
+        std::lock_guard<std::mutex> guard(r->lock);
+        r->mode = mode;
+
+        repl_frame_t hdr;
+        string body;
+        if (repl_recv(fd, hdr, body) != 0 || hdr.type != GTFS_REPL_HELLO) {
+            ERROR_PRINT("no hello from follower\n");
+            return ret;
+        }
+        // A restarted leader continues after whatever the follower already has.
+        if (hdr.seq >= r->next_seq) {
+            r->next_seq = hdr.seq + 1;
+        }
+        if (hdr.seq > r->acked) {
+            r->acked = hdr.seq;
+        }
+        repl_trim(r);
+        r->fd = fd;
+
+        // What this process shipped before its first catch-up, and what the
+        // backlog dropped, the follower may never have seen.
+        if ((r->caught_up == 0 || hdr.seq < r->caught_up || hdr.seq < r->dropped) &&
+            repl_catch_up(gtfs, r) != 0) {
+            r->fd = -1;
+            return ret;
+        }
+        for (size_t i = 0; i < r->backlog.size() && r->fd >= 0; i++) {
+            if (repl_write_full(fd, r->backlog[i].second.data(), r->backlog[i].second.size()) != 0) {
+                r->fd = -1;
+            }
+        }
+        if (r->fd < 0) {
+            return ret;
+        }
+        if (mode == GTFS_REPL_SYNC && repl_wait_ack(r, r->next_seq - 1, GTFS_REPL_TIMEOUT_MS) != 0) {
+            return ret;
+        }
+        ret = 0;
+
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+// Stops shipping; records synced from now on are kept for the next attach.
+int gtfs_repl_detach(gtfs_t* gtfs) {
+    if (gtfs == NULL || gtfs->repl == NULL) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(gtfs->repl->lock);
+    gtfs->repl->fd = -1;
+    return 0;
+}
+
+// Waits until the follower acknowledged everything shipped so far.
+int gtfs_repl_flush(gtfs_t* gtfs) {
+    if (gtfs == NULL || gtfs->repl == NULL) {
+        return -1;
+    }
+    repl_t* r = gtfs->repl;
+    std::lock_guard<std::mutex> guard(r->lock);
+    return repl_wait_ack(r, r->next_seq - 1, GTFS_REPL_TIMEOUT_MS);
+}
+
+static uint64_t repl_load_seq(const string& path) {
+    string text;
+    unsigned long long seq = 0;
+    if (gtfs_io_read_file(path, text) == 0) {
+        istringstream in(text);
+        if (!(in >> seq)) {
+            seq = 0;
+        }
+    }
+    return seq;
+}
+
+static int repl_store_seq(const string& path, uint64_t seq) {
+    string tmp = path + ".tmp";
+    string s = to_string(seq) + "\n";
+    int fd = gtfs_io()->open(tmp.c_str(), O_CREAT|O_WRONLY|O_TRUNC, S_IRWXU);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = (gtfs_io()->write(fd, s.data(), s.size()) == (ssize_t)s.size() && gtfs_io()->fdatasync(fd) == 0) ? 0 : -1;
+    gtfs_io()->close(fd);
+    return ret == 0 ? gtfs_io()->rename(tmp.c_str(), path.c_str()) : -1;
+}
+
+static int repl_apply(gtfs_t* gtfs, const string& body) {
+    vector<log_record_t> records;
+    if (gtfs_log_scan(body.data(), body.size(), records) != body.size() || records.size() != 1) {
+        return -1;
+    }
+    const log_record_t& rec = records[0];
+    if (rec.filename.empty() || rec.filename[0] == '.' || rec.filename.find('/') != string::npos) {
+        return -1;
+    }
+
+    string path = gtfs->dirname + "/" + rec.filename;
+    if (rec.encoding == GTFS_ENC_REMOVE) {
+        if (gtfs_wal_commit(gtfs, body, vector<string>(1, rec.filename)) != 0) {
+            return -1;
+        }
+        gtfs_io()->unlink(path.c_str());
+        gtfs_io()->unlink((path + ".dict").c_str());
+        if (gtfs->flags & GTFS_INIT_DEDUP) {
+            gtfs_blocks_forget(gtfs, rec.filename);
+        }
+        gtfs_catalog_remove(gtfs, rec.filename);
+        return 0;
+    }
+    int fd = gtfs_io()->open(path.c_str(), O_CREAT|O_RDWR, S_IRWXU);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat s;
+    gtfs_io()->fstat(fd, &s);
+    off_t need = (off_t)rec.offset + rec.length + 1;
+    if (s.st_size < need && gtfs_io()->ftruncate(fd, need) != 0) {
+        gtfs_io()->close(fd);
+        return -1;
+    }
+    gtfs_io()->close(fd);
+    return gtfs_wal_commit(gtfs, body, vector<string>(1, rec.filename));
+}
+
+// Ahead of a catch-up every file goes, so none the leader no longer has
+// survives it.
+static int repl_reset(gtfs_t* gtfs) {
+    vector<string> files = gtfs_catalog_scan(gtfs->dirname);
+    for (size_t i = 0; i < files.size(); i++) {
+        log_record_t rec;
+        rec.filename = files[i];
+        rec.length = 0;
+        rec.offset = 0;
+        rec.encoding = GTFS_ENC_REMOVE;
+        rec.dict_id = 0;
+        rec.payload = "";
+        rec.stored_length = 0;
+        string body;
+        gtfs_log_encode(body, rec);
+        if (repl_apply(gtfs, body) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Follower loop: commits shipped records to this directory's log and
+// acknowledges each one once durable. Returns 0 when the leader hangs up.
+int gtfs_repl_follow(gtfs_t* gtfs, int fd) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Following leader into directory " << gtfs->dirname << "\n");
+
+        string seq_path = gtfs->dirname + "/" GTFS_REPL_SEQ_NAME;
+        uint64_t last = repl_load_seq(seq_path);
+        string hello = repl_pack(GTFS_REPL_HELLO, last, "");
+        if (repl_write_full(fd, hello.data(), hello.size()) != 0) {
+            return ret;
+        }
+
+        repl_frame_t hdr;
+        string body;
+        while (repl_recv(fd, hdr, body) == 0) {
+            if (hdr.type != GTFS_REPL_RECORD && hdr.type != GTFS_REPL_RESET) {
+                continue;
+            }
+            if (hdr.seq > last) {
+                int applied = hdr.type == GTFS_REPL_RESET ? repl_reset(gtfs) : repl_apply(gtfs, body);
+                if (applied != 0 || repl_store_seq(seq_path, hdr.seq) != 0) {
+                    ERROR_PRINT("cannot apply record " << hdr.seq << "\n");
+                    return ret;
+                }
+                last = hdr.seq;
+            }
+            string ack = repl_pack(GTFS_REPL_ACK, hdr.seq, "");
+            if (repl_write_full(fd, ack.data(), ack.size()) != 0) {
+                break;
+            }
+        }
+        ret = 0;
+
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
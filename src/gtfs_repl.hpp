@@ -0,0 +1,54 @@
+#ifndef GTFS_REPL
+#define GTFS_REPL
+
+#include "gtfs.hpp"
+#include "gtfs_log.hpp"
+
+#include <stdint.h>
+#include <deque>
+#include <mutex>
+
+// Log shipping wire format: a fixed frame header followed by `length` body
+// bytes. RECORD bodies are redo log records in the on-disk log format.
+
+#define GTFS_REPL_MAGIC 0x50525447u   // "GTRP"
+
+#define GTFS_REPL_HELLO  1   // follower -> leader, seq = last applied record
+#define GTFS_REPL_RECORD 2   // leader -> follower
+#define GTFS_REPL_ACK    3   // follower -> leader, seq = record made durable
+#define GTFS_REPL_RESET  4   // leader -> follower: drop every file, a catch-up follows
+
+// The leader keeps unacknowledged records in memory up to this many bytes of
+// frames, dropping the oldest past it. A follower that misses records the
+// backlog no longer has, or that attaches to a leader process for the first
+// time, is caught up from the leader's files instead: a RESET, then each file
+// in records of at most GTFS_REPL_CHUNK bytes.
+#define GTFS_REPL_BACKLOG_MAX ((size_t)16 << 20)
+#define GTFS_REPL_CHUNK ((size_t)1 << 20)
+
+#define GTFS_REPL_SEQ_NAME ".repl_seq"   // the follower's last applied record
+
+typedef struct repl_frame {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;
+    uint64_t length;
+    uint32_t crc;
+    uint32_t reserved;   // zero
+} repl_frame_t;
+
+typedef struct repl {
+    int fd;              // -1 while no follower is attached
+    int mode;
+    uint64_t next_seq;
+    uint64_t acked;
+    std::deque<std::pair<uint64_t, std::string> > backlog;   // shipped but not acknowledged
+    size_t backlog_bytes;
+    uint64_t dropped;    // last record dropped from the backlog unacknowledged
+    uint64_t caught_up;  // last record of the latest catch-up, 0 before one
+    std::mutex lock;
+} repl_t;
+
+int gtfs_repl_ship(gtfs_t* gtfs, const log_record_t& rec);
+
+#endif
@@ -0,0 +1,293 @@
+#include "gtfs_simd.hpp"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GTFS_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define GTFS_SIMD_X86 0
+#endif
+
+#define CRC32C_POLY 0x82F63B78u
+
+// The SSE4.2 kernel runs three independent crc32 chains over adjacent lanes
+// to hide the instruction latency, then merges them by shifting the earlier
+// lanes' registers over CRC_LANE zero bytes with a table.
+#define CRC_LANE 1024
+
+typedef uint32_t (*crc_fn)(uint32_t, const unsigned char*, size_t);
+typedef size_t (*diff_fn)(const unsigned char*, const unsigned char*, size_t);
+
+static uint32_t crc_table[8][256];
+static uint32_t crc_shift_table[4][256];
+static int simd_best = GTFS_SIMD_SCALAR;
+static int simd_current = GTFS_SIMD_SCALAR;
+static crc_fn crc_impl;
+static diff_fn diff_impl;
+
+// ---- scalar ----
+
+static uint32_t crc_scalar(uint32_t crc, const unsigned char* p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = crc_table[7][v & 0xFF] ^ crc_table[6][(v >> 8) & 0xFF] ^
+              crc_table[5][(v >> 16) & 0xFF] ^ crc_table[4][(v >> 24) & 0xFF] ^
+              crc_table[3][(v >> 32) & 0xFF] ^ crc_table[2][(v >> 40) & 0xFF] ^
+              crc_table[1][(v >> 48) & 0xFF] ^ crc_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+static size_t diff_scalar(const unsigned char* a, const unsigned char* b, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y) {
+            return i + (size_t)(__builtin_ctzll(x ^ y) >> 3);
+        }
+    }
+    for (; i < len; i++) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+    }
+    return len;
+}
+
+static uint32_t crc_shift(uint32_t crc) {
+    return crc_shift_table[0][crc & 0xFF] ^ crc_shift_table[1][(crc >> 8) & 0xFF] ^
+           crc_shift_table[2][(crc >> 16) & 0xFF] ^ crc_shift_table[3][crc >> 24];
+}
+
+#if GTFS_SIMD_X86
+
+// ---- SSE4.2 ----
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char* p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    while (len >= 3 * CRC_LANE) {
+        uint64_t c0 = crc, c1 = 0, c2 = 0;
+        const unsigned char* p1 = p + CRC_LANE;
+        const unsigned char* p2 = p + 2 * CRC_LANE;
+        for (size_t i = 0; i < CRC_LANE; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p1 + i, 8);
+            memcpy(&v2, p2 + i, 8);
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        crc = crc_shift(crc_shift((uint32_t)c0) ^ (uint32_t)c1) ^ (uint32_t)c2;
+        p += 3 * CRC_LANE;
+        len -= 3 * CRC_LANE;
+    }
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+
+__attribute__((target("sse2")))
+static size_t diff_sse2(const unsigned char* a, const unsigned char* b, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if (mask != 0xFFFF) {
+            return i + (size_t)__builtin_ctz(~mask);
+        }
+    }
+    return i + diff_scalar(a + i, b + i, len - i);
+}
+
+// ---- AVX2 ----
+
+__attribute__((target("avx2")))
+static size_t diff_avx2(const unsigned char* a, const unsigned char* b, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y0 = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i x1 = _mm256_loadu_si256((const __m256i*)(a + i + 32));
+        __m256i y1 = _mm256_loadu_si256((const __m256i*)(b + i + 32));
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(x0, y0), _mm256_cmpeq_epi8(x1, y1));
+        if ((unsigned int)_mm256_movemask_epi8(eq) != 0xFFFFFFFFu) {
+            break;
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (mask != 0xFFFFFFFFu) {
+            return i + (size_t)__builtin_ctz(~mask);
+        }
+    }
+    return i + diff_scalar(a + i, b + i, len - i);
+}
+
+// ---- AVX-512 ----
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t diff_avx512(const unsigned char* a, const unsigned char* b, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m512i x = _mm512_loadu_si512((const void*)(a + i));
+        __m512i y = _mm512_loadu_si512((const void*)(b + i));
+        __mmask64 ne = _mm512_cmpneq_epi8_mask(x, y);
+        if (ne != 0) {
+            return i + (size_t)__builtin_ctzll(ne);
+        }
+    }
+    if (i < len) {
+        __mmask64 tail = (1ull << (len - i)) - 1;
+        __m512i x = _mm512_maskz_loadu_epi8(tail, (const void*)(a + i));
+        __m512i y = _mm512_maskz_loadu_epi8(tail, (const void*)(b + i));
+        __mmask64 ne = _mm512_cmpneq_epi8_mask(x, y);
+        if (ne != 0) {
+            return i + (size_t)__builtin_ctzll(ne);
+        }
+    }
+    return len;
+}
+
+#endif
+
+// ---- dispatch ----
+
+static void simd_init_tables() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t c = crc_table[t - 1][i];
+            crc_table[t][i] = crc_table[0][c & 0xFF] ^ (c >> 8);
+        }
+    }
+
+    // Advancing a register over zero bytes is linear, so tabulate it per byte lane.
+    static const unsigned char zeros[CRC_LANE] = {0};
+    for (int k = 0; k < 4; k++) {
+        for (uint32_t b = 0; b < 256; b++) {
+            crc_shift_table[k][b] = crc_scalar(b << (8 * k), zeros, CRC_LANE);
+        }
+    }
+}
+
+int gtfs_simd_detect() {
+#if GTFS_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("sse4.2")) {
+        return GTFS_SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2")) {
+        return GTFS_SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return GTFS_SIMD_SSE42;
+    }
+#endif
+    return GTFS_SIMD_SCALAR;
+}
+
+static void simd_select(int level) {
+    crc_impl = crc_scalar;
+    diff_impl = diff_scalar;
+#if GTFS_SIMD_X86
+    // There is no wider crc32 instruction, so the AVX levels keep the SSE4.2 CRC.
+    if (level >= GTFS_SIMD_SSE42) {
+        crc_impl = crc_sse42;
+        diff_impl = diff_sse2;
+    }
+    if (level >= GTFS_SIMD_AVX2) {
+        diff_impl = diff_avx2;
+    }
+    if (level >= GTFS_SIMD_AVX512) {
+        diff_impl = diff_avx512;
+    }
+#endif
+    simd_current = level;
+}
+
+static int simd_init() {
+    simd_init_tables();
+    simd_best = gtfs_simd_detect();
+    simd_select(simd_best);
+    return 0;
+}
+
+static void simd_ensure_init() {
+    static int initialized = simd_init();
+    (void)initialized;
+}
+
+int gtfs_simd_level() {
+    simd_ensure_init();
+    return simd_current;
+}
+
+int gtfs_simd_set_level(int level) {
+    simd_ensure_init();
+    if (level < GTFS_SIMD_SCALAR || level > simd_best) {
+        return -1;
+    }
+    simd_select(level);
+    return 0;
+}
+
+const char* gtfs_simd_level_name(int level) {
+    switch (level) {
+    case GTFS_SIMD_SCALAR: return "scalar";
+    case GTFS_SIMD_SSE42:  return "sse4.2";
+    case GTFS_SIMD_AVX2:   return "avx2";
+    case GTFS_SIMD_AVX512: return "avx512";
+    default:               return "unknown";
+    }
+}
+
+uint32_t gtfs_crc32c(uint32_t crc, const void* buf, size_t len) {
+    simd_ensure_init();
+    return ~crc_impl(~crc, (const unsigned char*)buf, len);
+}
+
+size_t gtfs_first_diff(const void* a, const void* b, size_t len) {
+    simd_ensure_init();
+    return diff_impl((const unsigned char*)a, (const unsigned char*)b, len);
+}
@@ -0,0 +1,31 @@
+#ifndef GTFS_SIMD
+#define GTFS_SIMD
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Runtime-dispatched checksum and compare kernels. The best level supported by
+// the CPU is picked on first use; gtfs_simd_set_level() can force a lower one
+// (used by the benchmarks and to test the fallbacks).
+
+#define GTFS_SIMD_SCALAR 0
+#define GTFS_SIMD_SSE42  1
+#define GTFS_SIMD_AVX2   2
+#define GTFS_SIMD_AVX512 3
+
+int gtfs_simd_detect();
+int gtfs_simd_level();
+int gtfs_simd_set_level(int level);
+const char* gtfs_simd_level_name(int level);
+
+// CRC32C (Castagnoli), standard pre/post inversion: gtfs_crc32c(0, "123456789", 9) == 0xE3069283.
+uint32_t gtfs_crc32c(uint32_t crc, const void* buf, size_t len);
+
+// Index of the first differing byte, or len if the ranges are equal.
+size_t gtfs_first_diff(const void* a, const void* b, size_t len);
+
+static inline bool gtfs_range_equal(const void* a, const void* b, size_t len) {
+    return gtfs_first_diff(a, b, len) == len;
+}
+
+#endif
@@ -0,0 +1,320 @@
+#include "gtfs.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_io.hpp"
+#include "gtfs_log.hpp"
+#include "gtfs_wal.hpp"
+#include "gtfs_blocks.hpp"
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+// A snapshot is a directory holding a clone of every base file, dictionary
+// and the log prefix at creation time, plus a MANIFEST listing them. It is
+// built under a hidden temporary name and renamed into place, so a visible
+// snapshot is always complete. The log is cloned before base files, and a
+// shared lock on it is held until the last base file is cloned. Commits and
+// checkpoints need it exclusively, so no base file can take a record past the
+// cloned prefix; one that a close replays meanwhile only holds records of the
+// prefix, which restore then redoes over the same bytes.
+
+static string snapshot_root(gtfs_t* gtfs) {
+    return gtfs->dirname + "/" GTFS_SNAPSHOT_DIR;
+}
+
+static bool snapshot_name_ok(const string& name) {
+    return !name.empty() && name[0] != '.' && name.find('/') == string::npos &&
+           name.size() <= MAX_FILENAME_LEN;
+}
+
+// Shares extents with FICLONE where the filesystem supports reflinks and
+// falls back to an in-kernel copy_file_range otherwise.
+static int snapshot_clone(const string& src, const string& dst, off_t len) {
+    int sfd = gtfs_io()->open(src.c_str(), O_RDONLY);
+    if (sfd < 0) {
+        return -1;
+    }
+    int dfd = gtfs_io()->open(dst.c_str(), O_CREAT|O_EXCL|O_WRONLY, S_IRWXU);
+    if (dfd < 0) {
+        gtfs_io()->close(sfd);
+        return -1;
+    }
+
+    int ret = 0;
+    if (ioctl(dfd, FICLONE, sfd) == 0) {
+        struct stat s;
+        gtfs_io()->fstat(dfd, &s);
+        if (s.st_size > len) {
+            ret = gtfs_io()->ftruncate(dfd, len);
+        }
+    } else {
+        off_t left = len;
+        while (left > 0) {
+            ssize_t n = copy_file_range(sfd, NULL, dfd, NULL, (size_t)left, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            left -= n;
+        }
+        if (left > 0) {
+            char buf[65536];
+            gtfs_io()->lseek(sfd, len - left, SEEK_SET);
+            while (left > 0) {
+                ssize_t n = gtfs_io()->read(sfd, buf, (size_t)(left < (off_t)sizeof(buf) ? left : (off_t)sizeof(buf)));
+                if (n <= 0 || gtfs_io()->write(dfd, buf, (size_t)n) != n) {
+                    ret = -1;
+                    break;
+                }
+                left -= n;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        ret = gtfs_io()->fdatasync(dfd);
+    }
+    gtfs_io()->close(dfd);
+    gtfs_io()->close(sfd);
+    return ret;
+}
+
+static void snapshot_remove_dir(const string& dir) {
+    vector<string> names;
+    if (gtfs_io()->list(dir.c_str(), &names) != 0) {
+        return;
+    }
+    for (size_t i = 0; i < names.size(); i++) {
+        if (gtfs_io()->unlink((dir + "/" + names[i]).c_str()) != 0 && errno == EISDIR) {
+            snapshot_remove_dir(dir + "/" + names[i]);
+        }
+    }
+    gtfs_io()->rmdir(dir.c_str());
+}
+
+static void snapshot_sync_dir(const string& dir) {
+    int fd = gtfs_io()->open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (fd >= 0) {
+        gtfs_io()->fsync(fd);
+        gtfs_io()->close(fd);
+    }
+}
+
+int gtfs_snapshot_create(gtfs_t* gtfs, string name) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Creating snapshot " << name << " of directory " << gtfs->dirname << "\n");
+
+        if (!snapshot_name_ok(name)) {
+            ERROR_PRINT("Invalid snapshot name " << name << "\n");
+            return ret;
+        }
+        string root = snapshot_root(gtfs);
+        string snap = root + "/" + name;
+        string tmp = root + "/." + name + ".tmp";
+        gtfs_io()->mkdir(root.c_str(), S_IRWXU);
+        if (gtfs_io()->access(snap.c_str(), F_OK) == 0) {
+            ERROR_PRINT("Snapshot " << name << " already exists\n");
+            return ret;
+        }
+        snapshot_remove_dir(tmp);
+        if (gtfs_io()->mkdir(tmp.c_str(), S_IRWXU) != 0) {
+            return ret;
+        }
+
+        // The log goes first. Its segments are listed under a shared lock,
+        // kept until the base files are cloned too.
+        vector<string> files;
+        string wal_dir = gtfs->dirname + "/" GTFS_WAL_NAME;
+        int wal_fd = gtfs_io()->open(wal_dir.c_str(), O_RDONLY|O_DIRECTORY);
+        if (wal_fd >= 0) {
+            gtfs_io()->flock(wal_fd, LOCK_SH);
+            gtfs_io()->mkdir((tmp + "/" GTFS_WAL_NAME).c_str(), S_IRWXU);
+            vector<uint64_t> segments = gtfs_wal_segments(wal_dir);
+            for (size_t i = 0; i < segments.size(); i++) {
+                files.push_back(GTFS_WAL_NAME "/" + gtfs_wal_segment_name(segments[i]));
+            }
+        }
+        size_t num_segments = files.size();
+        vector<string> names;
+        if (gtfs_io()->list(gtfs->dirname.c_str(), &names) != 0) {
+            if (wal_fd >= 0) {
+                gtfs_io()->close(wal_fd);
+            }
+            snapshot_remove_dir(tmp);
+            return ret;
+        }
+        for (size_t i = 0; i < names.size(); i++) {
+            const string& fname = names[i];
+            if (fname[0] == '.' || fname.find(".tmp.") != string::npos) {
+                continue;
+            }
+            struct stat s;
+            if (gtfs_io()->stat((gtfs->dirname + "/" + fname).c_str(), &s) != 0 || !S_ISREG(s.st_mode)) {
+                continue;
+            }
+            files.push_back(fname);
+        }
+        size_t num_listed = files.size();
+        vector<pair<string, off_t> > stored = gtfs_blocks_list(gtfs->dirname);
+        for (size_t i = 0; i < stored.size(); i++) {
+            if (find(files.begin() + (long)num_segments, files.begin() + (long)num_listed, stored[i].first) ==
+                files.begin() + (long)num_listed) {
+                files.push_back(stored[i].first);
+            }
+        }
+
+        std::stringstream manifest;
+        for (size_t i = 0; i < files.size(); i++) {
+            string src = gtfs->dirname + "/" + files[i];
+            struct stat s;
+            if (gtfs_io()->stat(src.c_str(), &s) != 0) {
+                // Moved into the block store meanwhile, or removed.
+                if (i >= num_segments && (gtfs->flags & GTFS_INIT_DEDUP) &&
+                    gtfs_blocks_export(gtfs, files[i], tmp + "/" + files[i]) == 0 &&
+                    gtfs_io()->stat((tmp + "/" + files[i]).c_str(), &s) == 0) {
+                    manifest << files[i] << " " << s.st_size << "\n";
+                }
+                continue;
+            }
+            if (snapshot_clone(src, tmp + "/" + files[i], s.st_size) != 0) {
+                ERROR_PRINT("Cannot copy " << src << " into snapshot\n");
+                if (wal_fd >= 0) {
+                    gtfs_io()->close(wal_fd);
+                }
+                snapshot_remove_dir(tmp);
+                return ret;
+            }
+            manifest << files[i] << " " << s.st_size << "\n";
+        }
+        if (wal_fd >= 0) {
+            gtfs_io()->close(wal_fd);
+        }
+        snapshot_sync_dir(tmp + "/" GTFS_WAL_NAME);
+
+        string mpath = tmp + "/MANIFEST";
+        int fd = gtfs_io()->open(mpath.c_str(), O_CREAT|O_WRONLY|O_TRUNC, S_IRWXU);
+        string m = manifest.str();
+        if (fd < 0 || gtfs_io()->write(fd, m.data(), m.size()) != (ssize_t)m.size() || gtfs_io()->fsync(fd) != 0) {
+            if (fd >= 0) {
+                gtfs_io()->close(fd);
+            }
+            snapshot_remove_dir(tmp);
+            return ret;
+        }
+        gtfs_io()->close(fd);
+        snapshot_sync_dir(tmp);
+
+        if (gtfs_io()->rename(tmp.c_str(), snap.c_str()) != 0) {
+            snapshot_remove_dir(tmp);
+            return ret;
+        }
+        snapshot_sync_dir(root);
+        ret = 0;
+
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_snapshot_delete(gtfs_t* gtfs, string name) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Deleting snapshot " << name << " of directory " << gtfs->dirname << "\n");
+
+        string snap = snapshot_root(gtfs) + "/" + name;
+        if (!snapshot_name_ok(name) || gtfs_io()->access(snap.c_str(), F_OK) != 0) {
+            ERROR_PRINT("No snapshot named " << name << "\n");
+            return ret;
+        }
+        snapshot_remove_dir(snap);
+        ret = 0;
+
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+// Opens a file as of the snapshot: the cloned base file is mapped privately
+// and its records in the cloned log prefix are replayed into that mapping,
+// leaving the snapshot itself untouched.
+file_t* gtfs_open_snapshot_file(gtfs_t* gtfs, string name, string filename) {
+    file_t *fl = NULL;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Opening file " << filename << " from snapshot " << name << " inside directory " << gtfs->dirname << "\n");
+
+        if (!snapshot_name_ok(name) || filename.size() > MAX_FILENAME_LEN) {
+            return NULL;
+        }
+        string key = string(GTFS_SNAPSHOT_DIR "/") + name + "/" + filename;
+        string path = gtfs->dirname + "/" + key;
+
+        int fd = gtfs_io()->open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            ERROR_PRINT("No file " << filename << " in snapshot " << name << "\n");
+            return NULL;
+        }
+        struct stat s;
+        gtfs_io()->fstat(fd, &s);
+        window_map_t* wm = NULL;
+        if (s.st_size > 0) {
+            wm = gtfs_window_map(fd, s.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+        }
+        if (wm == NULL) {
+            ERROR_PRINT("Virtual assignment failed\n");
+            gtfs_io()->close(fd);
+            return NULL;
+        }
+
+        wal_image_t image;
+        gtfs_wal_load(gtfs->dirname + "/" GTFS_SNAPSHOT_DIR "/" + name + "/" GTFS_WAL_NAME, image);
+        int status = gtfs_log_apply(gtfs_log_select(image.records, filename), wm, path);
+        gtfs_wal_release(image);
+        if (status != 0) {
+            ERROR_PRINT("Cannot apply the log of snapshot " << name << " to " << filename << "\n");
+            gtfs_window_unmap(wm);
+            gtfs_io()->close(fd);
+            return NULL;
+        }
+
+        fl = new file_t();
+        fl->filename = key;
+        fl->path = path;
+        fl->file_length = s.st_size;
+        fl->fd = fd;
+        fl->refs = 1;
+        fl->map = wm;
+        fl->addr = wm->windows.empty() ? NULL : wm->windows.begin()->second;
+        fl->flags = GTFS_OPEN_READONLY;
+        lock_guard<mutex> guard(*gtfs->files_lock);
+        (*(gtfs->file_add_dict)).insert(make_pair(key, fl->addr));
+
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return NULL;
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
+    return fl;
+}
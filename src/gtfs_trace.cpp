@@ -0,0 +1,212 @@
+#include "gtfs_trace.hpp"
+
+#include <atomic>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+// Bounded multi-producer ring (one sequence counter per cell). Producers never
+// block: if the drain thread falls behind, events are dropped and counted.
+
+#define TRACE_RING_SIZE (1 << 14)
+#define TRACE_BATCH 256
+
+typedef struct trace_cell {
+    atomic<size_t> seq;
+    trace_event_t ev;
+} trace_cell_t;
+
+static trace_cell_t trace_ring[TRACE_RING_SIZE];
+static atomic<size_t> trace_head(0);
+static atomic<size_t> trace_tail(0);
+static atomic<bool> trace_on(false);
+static atomic<bool> trace_stop_req(false);
+static atomic<uint64_t> trace_drops(0);
+static thread* trace_drainer = NULL;
+static int trace_fd = -1;
+
+static const char* trace_names[GTFS_EV_MAX] = {
+    "gtfs_init",
+    "gtfs_clean",
+    "gtfs_open_file",
+    "gtfs_close_file",
+    "gtfs_remove_file",
+    "gtfs_read_file",
+    "gtfs_write_file",
+    "gtfs_sync_write_file",
+    "gtfs_abort_write_file",
+    "log_replay",
+    "log_append"
+};
+
+const char* gtfs_trace_event_name(int id) {
+    if (id < 0 || id >= GTFS_EV_MAX) {
+        return "unknown";
+    }
+    return trace_names[id];
+}
+
+static uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t trace_tid() {
+    static thread_local uint32_t tid = 0;
+    if (tid == 0) {
+        tid = (uint32_t)syscall(SYS_gettid);
+    }
+    return tid;
+}
+
+static bool trace_push(const trace_event_t& ev) {
+    size_t pos = trace_head.load(memory_order_relaxed);
+    for (;;) {
+        trace_cell_t& cell = trace_ring[pos & (TRACE_RING_SIZE - 1)];
+        size_t seq = cell.seq.load(memory_order_acquire);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            if (trace_head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                cell.ev = ev;
+                cell.seq.store(pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = trace_head.load(memory_order_relaxed);
+        }
+    }
+}
+
+// Single consumer: only the drain thread pops.
+static bool trace_pop(trace_event_t& ev) {
+    size_t pos = trace_tail.load(memory_order_relaxed);
+    trace_cell_t& cell = trace_ring[pos & (TRACE_RING_SIZE - 1)];
+    size_t seq = cell.seq.load(memory_order_acquire);
+    if ((long)seq - (long)(pos + 1) < 0) {
+        return false;
+    }
+    ev = cell.ev;
+    cell.seq.store(pos + TRACE_RING_SIZE, memory_order_release);
+    trace_tail.store(pos + 1, memory_order_relaxed);
+    return true;
+}
+
+static void trace_write_all(const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(trace_fd, buf, len);
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static void trace_drain() {
+    trace_event_t batch[TRACE_BATCH];
+    for (;;) {
+        size_t n = 0;
+        while (n < TRACE_BATCH && trace_pop(batch[n])) {
+            n++;
+        }
+        if (n > 0) {
+            trace_write_all((const char*)batch, n * sizeof(trace_event_t));
+            continue;
+        }
+        if (trace_stop_req.load(memory_order_acquire)) {
+            return;
+        }
+        usleep(1000);
+    }
+}
+
+// A forked child does not inherit the drain thread, so it stops tracing
+// instead of filling the ring and writing into the parent's file.
+static void trace_atfork_child() {
+    trace_on.store(false, memory_order_relaxed);
+    trace_drainer = NULL;
+}
+
+static void trace_atexit() {
+    gtfs_trace_stop();
+}
+
+int gtfs_trace_start(string path) {
+    if (trace_on.load()) {
+        return -1;
+    }
+    trace_fd = open(path.c_str(), O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (trace_fd < 0) {
+        ERROR_PRINT("cannot open trace file " << path << "\n");
+        return -1;
+    }
+
+    trace_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, GTFS_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.pid = (uint32_t)getpid();
+    hdr.event_size = sizeof(trace_event_t);
+    trace_write_all((const char*)&hdr, sizeof(hdr));
+
+    static bool hooks_registered = false;
+    if (!hooks_registered) {
+        pthread_atfork(NULL, NULL, trace_atfork_child);
+        atexit(trace_atexit);
+        hooks_registered = true;
+    }
+
+    for (size_t i = 0; i < TRACE_RING_SIZE; i++) {
+        trace_ring[i].seq.store(i, memory_order_relaxed);
+    }
+    trace_head.store(0);
+    trace_tail.store(0);
+    trace_drops.store(0);
+    trace_stop_req.store(false);
+    trace_drainer = new thread(trace_drain);
+    trace_on.store(true, memory_order_release);
+    return 0;
+}
+
+int gtfs_trace_stop() {
+    if (!trace_on.exchange(false)) {
+        return -1;
+    }
+    trace_stop_req.store(true, memory_order_release);
+    trace_drainer->join();
+    delete trace_drainer;
+    trace_drainer = NULL;
+    close(trace_fd);
+    trace_fd = -1;
+    return 0;
+}
+
+bool gtfs_trace_active() {
+    return trace_on.load(memory_order_relaxed);
+}
+
+uint64_t gtfs_trace_dropped() {
+    return trace_drops.load();
+}
+
+void gtfs_trace_emit(int id, int phase, uint64_t arg) {
+    trace_event_t ev;
+    ev.ts_ns = trace_now();
+    ev.arg = arg;
+    ev.tid = trace_tid();
+    ev.id = (uint16_t)id;
+    ev.phase = (uint8_t)phase;
+    ev.pad = 0;
+    if (!trace_push(ev)) {
+        trace_drops.fetch_add(1, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef GTFS_TRACE
+#define GTFS_TRACE
+
+#include <string>
+#include <iostream>
+#include <stdint.h>
+
+// GTFileSystem diagnostics: compile-time leveled logging and a binary event trace
+
+#define GTFS_LOG_ERROR 0
+#define GTFS_LOG_INFO  1
+#define GTFS_LOG_DEBUG 2
+
+// Highest level compiled into the library. Anything above it is dead code
+// after template expansion, so the stream expression is never evaluated.
+#ifndef GTFS_LOG_LEVEL
+#define GTFS_LOG_LEVEL GTFS_LOG_INFO
+#endif
+
+template <int level>
+struct gtfs_log_enabled {
+    static constexpr bool value = level <= GTFS_LOG_LEVEL;
+};
+
+#define GTFS_LOG(level, verbose, ...) do { \
+    if (gtfs_log_enabled<level>::value && (verbose)) std::cout << __VA_ARGS__; \
+} while(0)
+
+#define VERBOSE_PRINT(verbose, ...) \
+    GTFS_LOG(GTFS_LOG_INFO, verbose, "VERBOSE: " << __FILE__ << ":" << __LINE__ << " " << __func__ << "(): " << __VA_ARGS__)
+
+#define DEBUG_PRINT(verbose, ...) \
+    GTFS_LOG(GTFS_LOG_DEBUG, verbose, "DEBUG: " << __func__ << "(): " << __VA_ARGS__)
+
+#define ERROR_PRINT(...) \
+    GTFS_LOG(GTFS_LOG_ERROR, 1, "ERROR: " << __func__ << "(): " << __VA_ARGS__)
+
+// Trace events. Spans are recorded as begin/end pairs in a lock-free ring
+// buffer and written to a binary trace file by a background thread.
+// tools/gtfs_trace_decode converts the file to Chrome trace JSON.
+
+#ifndef GTFS_ENABLE_TRACE
+#define GTFS_ENABLE_TRACE 1
+#endif
+
+#define GTFS_TRACE_MAGIC "GTFSTRC1"
+
+enum gtfs_trace_id {
+    GTFS_EV_INIT = 0,
+    GTFS_EV_CLEAN,
+    GTFS_EV_OPEN,
+    GTFS_EV_CLOSE,
+    GTFS_EV_REMOVE,
+    GTFS_EV_READ,
+    GTFS_EV_WRITE,
+    GTFS_EV_SYNC,
+    GTFS_EV_ABORT,
+    GTFS_EV_REPLAY,
+    GTFS_EV_LOG_APPEND,
+    GTFS_EV_MAX
+};
+
+enum gtfs_trace_phase {
+    GTFS_PH_BEGIN = 'B',
+    GTFS_PH_END = 'E',
+    GTFS_PH_INSTANT = 'i'
+};
+
+typedef struct trace_header {
+    char magic[8];
+    uint32_t pid;
+    uint32_t event_size;
+} trace_header_t;
+
+typedef struct trace_event {
+    uint64_t ts_ns;
+    uint64_t arg;
+    uint32_t tid;
+    uint16_t id;
+    uint8_t phase;
+    uint8_t pad;
+} trace_event_t;
+
+const char* gtfs_trace_event_name(int id);
+
+int gtfs_trace_start(std::string path);
+int gtfs_trace_stop();
+void gtfs_trace_emit(int id, int phase, uint64_t arg);
+bool gtfs_trace_active();
+uint64_t gtfs_trace_dropped();
+
+struct gtfs_trace_span {
+    int id;
+    bool on;
+    gtfs_trace_span(int ev, uint64_t arg) : id(ev), on(gtfs_trace_active()) {
+        if (on) gtfs_trace_emit(id, GTFS_PH_BEGIN, arg);
+    }
+    ~gtfs_trace_span() {
+        if (on) gtfs_trace_emit(id, GTFS_PH_END, 0);
+    }
+};
+
+#define GTFS_TRACE_CAT2(a, b) a##b
+#define GTFS_TRACE_CAT(a, b) GTFS_TRACE_CAT2(a, b)
+
+#if GTFS_ENABLE_TRACE
+#define GTFS_TRACE_SPAN(ev, arg) gtfs_trace_span GTFS_TRACE_CAT(trace_span_, __LINE__)((ev), (uint64_t)(arg))
+#else
+#define GTFS_TRACE_SPAN(ev, arg) do { } while(0)
+#endif
+
+#endif
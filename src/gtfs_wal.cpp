@@ -0,0 +1,761 @@
+#include "gtfs_wal.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_io.hpp"
+#include "gtfs_simd.hpp"
+#include "gtfs_catalog.hpp"
+#include "gtfs_blocks.hpp"
+#include "gtfs_quota.hpp"
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+#define WAL_MAX_REPLAY_THREADS 8
+#define WAL_PAGE 4096
+#define WAL_DIRECT_ALIGN 4096   // covers 512 and 4K logical sectors
+#define WAL_INDEX_MAGIC "GTFS-WALIDX"
+#define WAL_INDEX_MIN 64         // unlisted records before a segment's index is rewritten
+
+static const char wal_zeros[65536] = {0};
+
+string gtfs_wal_dir(gtfs_t* gtfs) {
+    return gtfs->dirname + "/" GTFS_WAL_NAME;
+}
+
+string gtfs_wal_segment_name(uint64_t seq) {
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)seq);
+    return name;
+}
+
+static bool wal_parse_seq(const string& name, uint64_t& seq) {
+    if (name.size() != 16 || name.find_first_not_of("0123456789abcdef") != string::npos) {
+        return false;
+    }
+    seq = strtoull(name.c_str(), NULL, 16);
+    return true;
+}
+
+static void wal_list(const string& dir, vector<uint64_t>& live, vector<uint64_t>& free,
+                     vector<string>* indexes = NULL) {
+    vector<string> names;
+    if (gtfs_io()->list(dir.c_str(), &names) != 0) {
+        return;
+    }
+    for (size_t i = 0; i < names.size(); i++) {
+        const string& name = names[i];
+        uint64_t seq;
+        if (wal_parse_seq(name, seq)) {
+            live.push_back(seq);
+        } else if (name.compare(0, 5, "free.") == 0 && wal_parse_seq(name.substr(5), seq)) {
+            free.push_back(seq);
+        } else if (indexes != NULL && name.compare(0, sizeof(GTFS_WAL_INDEX_PREFIX) - 1, GTFS_WAL_INDEX_PREFIX) == 0) {
+            indexes->push_back(name);
+        }
+    }
+    sort(live.begin(), live.end());
+    sort(free.begin(), free.end());
+}
+
+vector<uint64_t> gtfs_wal_segments(string wal_dir) {
+    vector<uint64_t> live, free;
+    wal_list(wal_dir, live, free);
+    return live;
+}
+
+static void wal_sync_dir(const string& dir) {
+    int fd = gtfs_io()->open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (fd >= 0) {
+        gtfs_io()->fsync(fd);
+        gtfs_io()->close(fd);
+    }
+}
+
+static int wal_pwrite(int fd, const char* p, size_t len, size_t pos) {
+    while (len > 0) {
+        ssize_t n = gtfs_io()->pwrite(fd, p, len, (off_t)pos);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        pos += (size_t)n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int wal_zero(int fd, size_t from, size_t to) {
+    while (from < to) {
+        size_t n = to - from < sizeof(wal_zeros) ? to - from : sizeof(wal_zeros);
+        ssize_t done = gtfs_io()->pwrite(fd, wal_zeros, n, (off_t)from);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return -1;
+        }
+        from += (size_t)done;
+    }
+    return 0;
+}
+
+// End of the valid records at or after `from`. Segments are zero-filled past
+// their tail, so a zero byte where a record would start ends the scan at once.
+static size_t wal_scan_from(const char* addr, size_t size, size_t from) {
+    if (from >= size || addr[from] == '\0') {
+        return from;
+    }
+    vector<log_record_t> records;
+    return from + gtfs_log_scan(addr + from, size - from, records);
+}
+
+// A torn append can leave bytes past the valid end; they reach at most up to
+// the first page that is still all zeros.
+static size_t wal_dirty_end(const char* addr, size_t size, size_t valid) {
+    size_t end = (valid + WAL_PAGE - 1) / WAL_PAGE * WAL_PAGE;
+    while (end < size) {
+        size_t n = size - end < WAL_PAGE ? size - end : WAL_PAGE;
+        if (gtfs_first_diff(addr + end, wal_zeros, n) == n) {
+            break;
+        }
+        end += n;
+    }
+    return end < size ? end : size;
+}
+
+static void wal_detach(wal_t* w) {
+    if (w->addr != NULL) {
+        gtfs_io()->munmap(w->addr, w->size);
+        w->addr = NULL;
+    }
+    if (w->fd >= 0) {
+        gtfs_io()->close(w->fd);
+        w->fd = -1;
+    }
+    if (w->dio_fd >= 0) {
+        gtfs_io()->close(w->dio_fd);
+        w->dio_fd = -1;
+    }
+}
+
+static int wal_attach(wal_t* w, const string& dir, uint64_t seq) {
+    wal_detach(w);
+    int fd = gtfs_io()->open((dir + "/" + gtfs_wal_segment_name(seq)).c_str(), O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat s;
+    gtfs_io()->fstat(fd, &s);
+    void* addr = gtfs_io()->mmap(NULL, (size_t)s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        gtfs_io()->close(fd);
+        return -1;
+    }
+    w->fd = fd;
+    w->seq = seq;
+    w->ino = s.st_ino;
+    w->addr = (char*)addr;
+    w->size = (size_t)s.st_size;
+    w->tail = wal_scan_from(w->addr, w->size, 0);
+    if (w->direct) {
+        w->dio_fd = gtfs_io()->open((dir + "/" + gtfs_wal_segment_name(seq)).c_str(), O_RDWR|O_DIRECT|O_DSYNC);
+        if (w->dio_fd < 0) {
+            DEBUG_PRINT(do_verbose, "no O_DIRECT on " << dir << ", using buffered log writes\n");
+        }
+    }
+    return 0;
+}
+
+// Starts a segment of at least `need` bytes, recycling a free one if possible.
+// It is named one past every sequence number in use, so a process still
+// holding a recycled segment sees its old name disappear.
+static int wal_new_segment(const string& dir, wal_t* w, size_t need) {
+    vector<uint64_t> live, free;
+    wal_list(dir, live, free);
+    uint64_t next = w->fd >= 0 ? w->seq : 0;
+    if (!live.empty()) {
+        next = max(next, live.back());
+    }
+    if (!free.empty()) {
+        next = max(next, free.back());
+    }
+    next++;
+    string path = dir + "/" + gtfs_wal_segment_name(next);
+
+    bool recycled = false;
+    for (size_t i = 0; i < free.size() && !recycled; i++) {
+        string fpath = dir + "/free." + gtfs_wal_segment_name(free[i]);
+        struct stat s;
+        if (gtfs_io()->stat(fpath.c_str(), &s) == 0 && (size_t)s.st_size >= need &&
+            gtfs_io()->rename(fpath.c_str(), path.c_str()) == 0) {
+            recycled = true;
+        }
+    }
+    if (!recycled) {
+        size_t size = need > GTFS_WAL_SEGMENT_SIZE ? need : GTFS_WAL_SEGMENT_SIZE;
+        size = (size + WAL_PAGE - 1) / WAL_PAGE * WAL_PAGE;
+        string tmp = dir + "/new.tmp";
+        int fd = gtfs_io()->open(tmp.c_str(), O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+        if (fd < 0) {
+            return -1;
+        }
+        // fallocate reserves the blocks; writing the zeros turns them into
+        // initialized extents, so appends never convert extents later.
+        if (gtfs_io()->fallocate(fd, 0, 0, (off_t)size) != 0 && gtfs_io()->ftruncate(fd, (off_t)size) != 0) {
+            gtfs_io()->close(fd);
+            gtfs_io()->unlink(tmp.c_str());
+            return -1;
+        }
+        if (wal_zero(fd, 0, size) != 0 || gtfs_io()->fdatasync(fd) != 0 || gtfs_io()->rename(tmp.c_str(), path.c_str()) != 0) {
+            gtfs_io()->close(fd);
+            gtfs_io()->unlink(tmp.c_str());
+            return -1;
+        }
+        gtfs_io()->close(fd);
+    }
+    wal_sync_dir(dir);
+    DEBUG_PRINT(do_verbose, (recycled ? "recycled" : "allocated") << " log segment " << gtfs_wal_segment_name(next) << "\n");
+    return wal_attach(w, dir, next);
+}
+
+// Re-establishes the tail under the directory lock: other processes may have
+// appended, started a new segment or checkpointed since our last commit.
+static int wal_find_tail(const string& dir, wal_t* w, size_t need) {
+    if (w->fd >= 0) {
+        struct stat s;
+        if (gtfs_io()->stat((dir + "/" + gtfs_wal_segment_name(w->seq)).c_str(), &s) != 0 || s.st_ino != w->ino) {
+            wal_detach(w);
+        } else {
+            w->tail = wal_scan_from(w->addr, w->size, w->tail);
+        }
+    }
+    // Live sequence numbers are always above the free ones, so another
+    // process moving past our segment must have created seq + 1.
+    if (w->fd >= 0 && gtfs_io()->access((dir + "/" + gtfs_wal_segment_name(w->seq + 1)).c_str(), F_OK) == 0) {
+        wal_detach(w);
+    }
+    if (w->fd < 0) {
+        vector<uint64_t> live = gtfs_wal_segments(dir);
+        if (!live.empty() && wal_attach(w, dir, live.back()) != 0) {
+            return -1;
+        }
+    }
+    if (w->fd < 0 || w->tail + need > w->size) {
+        return wal_new_segment(dir, w, need);
+    }
+    return 0;
+}
+
+// Writes buf at the tail through the O_DIRECT descriptor. The staging buffer
+// starts with the block the tail falls into, so earlier records in it are
+// rewritten unchanged, and ends with zero padding up to the next aligned
+// boundary, which keeps the zero-filled region past the tail intact.
+// O_DSYNC makes the write durable without a separate fdatasync.
+static int wal_write_direct(wal_t* w, const string& buf) {
+    size_t start = w->tail / WAL_DIRECT_ALIGN * WAL_DIRECT_ALIGN;
+    size_t head = w->tail - start;
+    size_t total = (head + buf.size() + WAL_DIRECT_ALIGN - 1) / WAL_DIRECT_ALIGN * WAL_DIRECT_ALIGN;
+    if (total > w->stage_size) {
+        void* stage = NULL;
+        if (posix_memalign(&stage, WAL_DIRECT_ALIGN, total) != 0) {
+            return -1;
+        }
+        free(w->stage);
+        w->stage = (char*)stage;
+        w->stage_size = total;
+    }
+    if (head > 0 && gtfs_io()->pread(w->dio_fd, w->stage, WAL_DIRECT_ALIGN, (off_t)start) != WAL_DIRECT_ALIGN) {
+        return -1;
+    }
+    memcpy(w->stage + head, buf.data(), buf.size());
+    memset(w->stage + head + buf.size(), 0, total - head - buf.size());
+    return wal_pwrite(w->dio_fd, w->stage, total, start);
+}
+
+static int wal_write(gtfs_t* gtfs, wal_t* w, const wal_batch_t& batch) {
+    const string& buf = batch.buf;
+    GTFS_TRACE_SPAN(GTFS_EV_LOG_APPEND, buf.size());
+    string dir = gtfs_wal_dir(gtfs);
+    if (w->pid != getpid()) {
+        // Inherited across fork; the flock would be shared with the parent.
+        wal_detach(w);
+        if (w->dfd >= 0) {
+            gtfs_io()->close(w->dfd);
+        }
+        w->dfd = -1;
+        w->pid = getpid();
+    }
+    if (w->dfd < 0) {
+        gtfs_io()->mkdir(dir.c_str(), S_IRWXU);
+        w->dfd = gtfs_io()->open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+        if (w->dfd < 0) {
+            ERROR_PRINT("cannot open log " << dir << "\n");
+            return -1;
+        }
+        wal_sync_dir(gtfs->dirname);
+    }
+
+    gtfs_io()->flock(w->dfd, LOCK_EX);
+    int ret = gtfs_catalog_pending(gtfs, batch.files);
+    if (ret == 0) {
+        ret = wal_find_tail(dir, w, buf.size());
+    }
+    if (ret == 0 && w->dio_fd >= 0) {
+        ret = wal_write_direct(w, buf);
+    } else if (ret == 0) {
+        ret = wal_pwrite(w->fd, buf.data(), buf.size(), w->tail);
+        if (ret == 0 && gtfs_io()->fdatasync(w->fd) != 0) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        w->tail += buf.size();
+        gtfs_catalog_logged(gtfs, batch.files, batch.writers, w->seq << GTFS_CATALOG_LSN_SHIFT | w->tail, buf.size());
+    }
+    gtfs_io()->flock(w->dfd, LOCK_UN);
+    return ret;
+}
+
+// Group commit: whoever finds no flush in progress writes out everything
+// queued so far while later committers queue behind it for the next batch.
+int gtfs_wal_commit(gtfs_t* gtfs, const string& buf, const vector<string>& files, const vector<uint64_t>& writers) {
+    gtfs_quota_admit(gtfs, buf.size(), files);
+    wal_t* w = gtfs->wal;
+    std::unique_lock<std::mutex> guard(w->lock);
+    if (!w->filling) {
+        w->filling = std::make_shared<wal_batch_t>();
+        w->filling->done = false;
+        w->filling->result = 0;
+    }
+    std::shared_ptr<wal_batch_t> mine = w->filling;
+    mine->buf.append(buf);
+    mine->files.insert(mine->files.end(), files.begin(), files.end());
+    for (size_t i = 0; i < files.size(); i++) {
+        mine->writers.push_back(i < writers.size() ? writers[i] : 0);
+    }
+
+    while (!mine->done) {
+        if (w->flushing) {
+            w->cv.wait(guard);
+            continue;
+        }
+        std::shared_ptr<wal_batch_t> batch = w->filling;
+        w->filling.reset();
+        w->flushing = true;
+        guard.unlock();
+        int result = wal_write(gtfs, w, *batch);
+        guard.lock();
+        batch->result = result;
+        batch->done = true;
+        w->flushing = false;
+        w->cv.notify_all();
+    }
+    return mine->result;
+}
+
+// Reads a decimal number and the separator after it.
+static bool wal_parse_u64(const char*& p, const char* end, char sep, uint64_t& v) {
+    const char* start = p;
+    v = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (uint64_t)(*p++ - '0');
+    }
+    if (p == start || p >= end || *p != sep) {
+        return false;
+    }
+    p++;
+    return true;
+}
+
+static string wal_index_path(const string& dir, uint64_t seq) {
+    return dir + "/" GTFS_WAL_INDEX_PREFIX + gtfs_wal_segment_name(seq);
+}
+
+// Records of the segment at seg listed by its index, and in end where they
+// stop. Any mismatch with the index's checksum or with the segment discards
+// the whole index. Headers are not parsed again, but every payload is checked
+// against its record's checksum as a scan would, and the last listed record
+// is checked against the segment in full, so an index of records that never
+// became durable is not trusted.
+static bool wal_index_load(const string& dir, uint64_t seq, const char* seg, size_t size,
+                           vector<log_record_t>& records, size_t& end) {
+    string text;
+    if (gtfs_io_read_file(wal_index_path(dir, seq), text) != 0) {
+        return false;
+    }
+    const char* p = text.data();
+    const char* stop = p + text.size();
+    const char* nl = (const char*)memchr(p, '\n', text.size());
+    uint64_t file_seq, file_end, count, crc;
+    if (nl == NULL || text.compare(0, sizeof(WAL_INDEX_MAGIC), WAL_INDEX_MAGIC " ") != 0) {
+        return false;
+    }
+    p += sizeof(WAL_INDEX_MAGIC);
+    if (!wal_parse_u64(p, stop, ' ', file_seq) || !wal_parse_u64(p, stop, ' ', file_end) ||
+        !wal_parse_u64(p, stop, ' ', count) || !wal_parse_u64(p, stop, '\n', crc) ||
+        file_seq != seq || file_end > size || crc != gtfs_crc32c(0, p, (size_t)(stop - p))) {
+        return false;
+    }
+    vector<log_record_t> listed;
+    size_t last = 0;
+    while (p < stop) {
+        uint64_t pos, payload, length, offset, encoding, stored, dict_id, rec_crc;
+        if (!wal_parse_u64(p, stop, ' ', pos) || !wal_parse_u64(p, stop, ' ', payload) ||
+            !wal_parse_u64(p, stop, ' ', length) || !wal_parse_u64(p, stop, ' ', offset) ||
+            !wal_parse_u64(p, stop, ' ', encoding) || !wal_parse_u64(p, stop, ' ', stored) ||
+            !wal_parse_u64(p, stop, ' ', dict_id) || !wal_parse_u64(p, stop, ' ', rec_crc)) {
+            return false;
+        }
+        nl = (const char*)memchr(p, '\n', (size_t)(stop - p));
+        if (nl == NULL || pos >= payload || payload > file_end || stored > file_end - payload) {
+            return false;
+        }
+        log_record_t rec;
+        rec.filename.assign(p, (size_t)(nl - p));
+        rec.length = (int64_t)length;
+        rec.offset = (int64_t)offset;
+        rec.encoding = (int)encoding;
+        rec.dict_id = (unsigned int)dict_id;
+        rec.payload = seg + payload;
+        rec.stored_length = (int64_t)stored;
+        rec.crc = (unsigned int)rec_crc;
+        if (gtfs_log_checksum(rec) != rec.crc) {
+            return false;
+        }
+        listed.push_back(rec);
+        last = (size_t)pos;
+        p = nl + 1;
+    }
+    vector<log_record_t> check;
+    if (listed.size() != count ||
+        (count > 0 && (gtfs_log_scan(seg + last, (size_t)file_end - last, check) != (size_t)file_end - last ||
+                       check.size() != 1 || check[0].payload != listed.back().payload))) {
+        return false;
+    }
+    records.insert(records.end(), listed.begin(), listed.end());
+    end = (size_t)file_end;
+    return true;
+}
+
+// Writes the index of the first count records of a segment, which end at
+// `end`. It is a cache: written without fsync, checked when read.
+static void wal_index_save(const string& dir, uint64_t seq, const char* seg, const log_record_t* records,
+                           size_t count, size_t end) {
+    static std::atomic<unsigned> saves(0);
+    string body;
+    for (size_t i = 0; i < count; i++) {
+        const log_record_t& rec = records[i];
+        // The header starts right after the end of the previous record.
+        size_t pos = i == 0 ? 0 : (size_t)(records[i - 1].payload - seg) + (size_t)records[i - 1].stored_length +
+                                  sizeof("\n" GTFS_LOG_TERMINATOR "\n") - 1;
+        body += to_string(pos) + " " + to_string(rec.payload - seg) + " " + to_string(rec.length) + " " +
+                to_string(rec.offset) + " " + to_string(rec.encoding) + " " + to_string(rec.stored_length) + " " +
+                to_string(rec.dict_id) + " " + to_string(rec.crc) + " " + rec.filename + "\n";
+    }
+    string text = WAL_INDEX_MAGIC " " + to_string(seq) + " " + to_string(end) + " " + to_string(count) + " " +
+                  to_string(gtfs_crc32c(0, body.data(), body.size())) + "\n" + body;
+    string path = wal_index_path(dir, seq);
+    string tmp = path + ".tmp." + to_string(getpid()) + "." + to_string(saves++);
+    int fd = gtfs_io()->open(tmp.c_str(), O_CREAT|O_TRUNC|O_WRONLY, S_IRWXU);
+    if (fd < 0) {
+        return;
+    }
+    bool ok = gtfs_io()->write(fd, text.data(), text.size()) == (ssize_t)text.size();
+    gtfs_io()->close(fd);
+    if (!ok || gtfs_io()->rename(tmp.c_str(), path.c_str()) != 0) {
+        gtfs_io()->unlink(tmp.c_str());
+    }
+}
+
+typedef struct wal_segment {
+    char* addr;
+    size_t size;
+    size_t end;
+    size_t indexed;
+    vector<log_record_t> records;
+} wal_segment_t;
+
+// Maps a segment and validates its records: those its index lists, then a
+// scan from where the index stops. The index is rewritten once the scan has
+// found WAL_INDEX_MIN records it does not list.
+static void wal_load_segment(const string& dir, uint64_t seq, bool index, wal_segment_t& out) {
+    out.addr = NULL;
+    out.end = 0;
+    out.indexed = 0;
+    int fd = gtfs_io()->open((dir + "/" + gtfs_wal_segment_name(seq)).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat s;
+    gtfs_io()->fstat(fd, &s);
+    out.size = (size_t)s.st_size;
+    void* addr = out.size > 0 ? gtfs_io()->mmap(NULL, out.size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    gtfs_io()->close(fd);
+    if (addr == MAP_FAILED) {
+        return;
+    }
+    out.addr = (char*)addr;
+    if (out.addr[0] == '\0') {
+        return;
+    }
+    if (wal_index_load(dir, seq, out.addr, out.size, out.records, out.end)) {
+        out.indexed = out.records.size();
+    }
+    if (out.end < out.size && out.addr[out.end] != '\0') {
+        out.end += gtfs_log_scan(out.addr + out.end, out.size - out.end, out.records);
+    }
+    if (index && out.records.size() >= out.indexed + WAL_INDEX_MIN) {
+        wal_index_save(dir, seq, out.addr, out.records.data(), out.records.size(), out.end);
+    }
+}
+
+// Segments are validated in parallel, one per worker at a time; records do
+// not span segments.
+int gtfs_wal_load(string wal_dir, wal_image_t& image, bool index) {
+    image.indexed = 0;
+    if (gtfs_io()->access(wal_dir.c_str(), F_OK) != 0) {
+        return -1;
+    }
+    vector<uint64_t> live = gtfs_wal_segments(wal_dir);
+    vector<wal_segment_t> segments(live.size());
+    std::atomic<size_t> next(0);
+    size_t nthreads = std::thread::hardware_concurrency();
+    nthreads = nthreads < 1 ? 1 : nthreads > WAL_MAX_REPLAY_THREADS ? WAL_MAX_REPLAY_THREADS : nthreads;
+    nthreads = nthreads > live.size() ? live.size() : nthreads;
+    vector<thread> workers;
+    for (size_t t = 1; t < nthreads; t++) {
+        workers.push_back(thread([&]() {
+            for (size_t i = next++; i < live.size(); i = next++) {
+                wal_load_segment(wal_dir, live[i], index, segments[i]);
+            }
+        }));
+    }
+    for (size_t i = next++; i < live.size(); i = next++) {
+        wal_load_segment(wal_dir, live[i], index, segments[i]);
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (segments[i].addr == NULL) {
+            continue;
+        }
+        image.maps.push_back(make_pair(segments[i].addr, segments[i].size));
+        image.ends.push_back(segments[i].end);
+        image.seqs.push_back(live[i]);
+        image.records.insert(image.records.end(), segments[i].records.begin(), segments[i].records.end());
+        image.indexed += segments[i].indexed;
+    }
+    return 0;
+}
+
+void gtfs_wal_release(wal_image_t& image) {
+    for (size_t i = 0; i < image.maps.size(); i++) {
+        gtfs_io()->munmap(image.maps[i].first, image.maps[i].second);
+    }
+    image.maps.clear();
+    image.ends.clear();
+    image.seqs.clear();
+    image.records.clear();
+    image.indexed = 0;
+}
+
+// Redoes records on the on-disk base file through a shared mapping. A file
+// that no longer exists is skipped.
+static int wal_apply_file(const string& base_path, const vector<log_record_t>& records, bool durable) {
+    int fd = gtfs_io()->open(base_path.c_str(), O_RDWR);
+    if (fd < 0) {
+        DEBUG_PRINT(do_verbose, "no base file " << base_path << "\n");
+        return 0;
+    }
+    struct stat s;
+    gtfs_io()->fstat(fd, &s);
+    // Nothing syncs the size a base file is given at open, so after a crash
+    // it can be shorter than its records, or empty.
+    off_t need = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        need = max(need, (off_t)(records[i].offset + records[i].length));
+    }
+    if (s.st_size < need && gtfs_io()->ftruncate(fd, need) == 0) {
+        s.st_size = need;
+    }
+    window_map_t* wm = NULL;
+    if (s.st_size > 0) {
+        wm = gtfs_window_map(fd, s.st_size, PROT_READ | PROT_WRITE, MAP_SHARED);
+    }
+    if (wm == NULL) {
+        ERROR_PRINT("file not in virtual memory\n");
+        gtfs_io()->close(fd);
+        return -1;
+    }
+
+    int ret = gtfs_log_apply(records, wm, base_path);
+    if (ret == 0 && durable && gtfs_window_sync(wm) != 0) {
+        ret = -1;
+    }
+    gtfs_window_unmap(wm);
+    gtfs_io()->close(fd);
+    return ret;
+}
+
+// Redoes one file's committed records on its base file. Returns -1 if the
+// directory has no log.
+int gtfs_wal_replay(gtfs_t* gtfs, string filename) {
+    string dir = gtfs_wal_dir(gtfs);
+    int dfd = gtfs_io()->open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (dfd < 0) {
+        return -1;
+    }
+    GTFS_TRACE_SPAN(GTFS_EV_REPLAY, 0);
+    gtfs_io()->flock(dfd, LOCK_SH);
+
+    int ret = 0;
+    wal_image_t image;
+    gtfs_wal_load(dir, image, true);
+    vector<log_record_t> mine = gtfs_log_select(image.records, filename);
+    if (!mine.empty()) {
+        ret = wal_apply_file(gtfs->dirname + "/" + filename, mine, false);
+    }
+    if (ret == 0) {
+        gtfs_catalog_replayed(gtfs, filename);
+    }
+    gtfs_wal_release(image);
+    gtfs_io()->close(dfd);
+    return ret;
+}
+
+// Makes the records of files durable in their base files and clears their
+// pending marks in the catalog.
+int gtfs_wal_recover(gtfs_t* gtfs, const vector<string>& files) {
+    string dir = gtfs_wal_dir(gtfs);
+    int dfd = gtfs_io()->open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (dfd < 0) {
+        gtfs_catalog_applied(gtfs, files);
+        return 0;
+    }
+    GTFS_TRACE_SPAN(GTFS_EV_REPLAY, files.size());
+    gtfs_io()->flock(dfd, LOCK_SH);
+
+    int ret = 0;
+    wal_image_t image;
+    gtfs_wal_load(dir, image, true);
+    for (size_t i = 0; i < files.size(); i++) {
+        vector<log_record_t> mine = gtfs_log_select(image.records, files[i]);
+        if (!mine.empty() && wal_apply_file(gtfs->dirname + "/" + files[i], mine, true) != 0) {
+            ret = -1;
+        }
+    }
+    gtfs_wal_release(image);
+    if (ret == 0) {
+        gtfs_catalog_applied(gtfs, files);
+    }
+    gtfs_io()->close(dfd);
+    return ret;
+}
+
+// Redoes every file's records, one file per worker, makes the base files
+// durable and only then recycles the segments. A record that cannot be
+// applied fails the checkpoint and leaves every segment in place.
+int gtfs_wal_checkpoint(gtfs_t* gtfs) {
+    string dir = gtfs_wal_dir(gtfs);
+    int dfd = gtfs_io()->open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (dfd < 0) {
+        return -1;
+    }
+    GTFS_TRACE_SPAN(GTFS_EV_REPLAY, 1);
+    gtfs_io()->flock(dfd, LOCK_EX);
+
+    wal_image_t image;
+    gtfs_wal_load(dir, image);
+    map<string, vector<log_record_t> > per_file;
+    for (size_t i = 0; i < image.records.size(); i++) {
+        vector<log_record_t>& recs = per_file[image.records[i].filename];
+        if (image.records[i].encoding == GTFS_ENC_REMOVE) {
+            recs.clear();
+        } else {
+            recs.push_back(image.records[i]);
+        }
+    }
+    vector<pair<string, vector<log_record_t>*> > files;
+    for (map<string, vector<log_record_t> >::iterator it = per_file.begin(); it != per_file.end(); it++) {
+        if (!it->second.empty()) {
+            files.push_back(make_pair(gtfs->dirname + "/" + it->first, &it->second));
+        }
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<int> failed(0);
+    size_t nthreads = std::thread::hardware_concurrency();
+    nthreads = nthreads < 1 ? 1 : nthreads > WAL_MAX_REPLAY_THREADS ? WAL_MAX_REPLAY_THREADS : nthreads;
+    nthreads = nthreads > files.size() ? files.size() : nthreads;
+    vector<thread> workers;
+    for (size_t t = 0; t < nthreads; t++) {
+        workers.push_back(thread([&]() {
+            for (size_t i = next++; i < files.size(); i = next++) {
+                if (wal_apply_file(files[i].first, *files[i].second, true) != 0) {
+                    failed++;
+                }
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    // Every record is in a base file now; wipe what each segment used and
+    // park it for reuse. A stale record must never survive in a recycled
+    // segment, so the zeros are durable before the rename.
+    int ret = failed == 0 ? 0 : -1;
+    if (ret == 0) {
+        uint64_t end = image.seqs.empty() ? 0 : image.seqs.back() << GTFS_CATALOG_LSN_SHIFT | image.ends.back();
+        gtfs_catalog_checkpointed(gtfs, end);
+    }
+    for (size_t i = 0; ret == 0 && i < image.seqs.size(); i++) {
+        string name = gtfs_wal_segment_name(image.seqs[i]);
+        int fd = gtfs_io()->open((dir + "/" + name).c_str(), O_RDWR);
+        size_t end = wal_dirty_end(image.maps[i].first, image.maps[i].second, image.ends[i]);
+        if (fd < 0 || wal_zero(fd, 0, end) != 0 || gtfs_io()->fdatasync(fd) != 0 ||
+            gtfs_io()->rename((dir + "/" + name).c_str(), (dir + "/free." + name).c_str()) != 0) {
+            ret = -1;
+        }
+        if (fd >= 0) {
+            gtfs_io()->close(fd);
+        }
+    }
+    gtfs_wal_release(image);
+    if (ret == 0 && (gtfs->flags & GTFS_INIT_DEDUP) && gtfs_blocks_checkpoint(gtfs) != 0) {
+        ret = -1;
+    }
+
+    vector<uint64_t> live, free;
+    vector<string> indexes;
+    wal_list(dir, live, free, &indexes);
+    for (size_t i = 0; i + GTFS_WAL_FREE_SEGMENTS < free.size(); i++) {
+        gtfs_io()->unlink((dir + "/free." + gtfs_wal_segment_name(free[i])).c_str());
+    }
+    // Indexes of recycled segments, and temporaries a crash left behind.
+    for (size_t i = 0; i < indexes.size(); i++) {
+        uint64_t seq;
+        string rest = indexes[i].substr(sizeof(GTFS_WAL_INDEX_PREFIX) - 1);
+        if (!wal_parse_seq(rest, seq) || !binary_search(live.begin(), live.end(), seq)) {
+            gtfs_io()->unlink((dir + "/" + indexes[i]).c_str());
+        }
+    }
+    wal_sync_dir(dir);
+    gtfs_io()->close(dfd);
+    return ret;
+}
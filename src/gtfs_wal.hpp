@@ -0,0 +1,97 @@
+#ifndef GTFS_WAL
+#define GTFS_WAL
+
+#include "gtfs.hpp"
+#include "gtfs_log.hpp"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+// Directory-wide write-ahead log. Every file's redo records go to one log,
+// tagged by file name, so a commit costs one write and one fdatasync no
+// matter how many files it touches.
+//
+// The log is a directory of fixed-size segments named by a 16 hex digit
+// sequence number. Segments are preallocated and zero-filled, so an append
+// overwrites blocks that already exist and fdatasync has no metadata to
+// flush. The tail is found by scanning for the end of valid records. A
+// checkpoint zeroes the used part of each segment and parks it as
+// free.<seq>; the next segment is a recycled one renamed to a sequence
+// number larger than any before it.
+//
+// Appenders and checkpoints hold an exclusive flock on the log directory,
+// readers a shared one.
+//
+// With GTFS_INIT_DIRECT_LOG appends bypass the page cache: records are packed
+// into an aligned staging buffer, padded to whole blocks and written with
+// O_DIRECT, so log traffic does not evict the pages behind the file mappings.
+//
+// Loading validates the segments in parallel. A load under the shared lock
+// also leaves index.<seq> next to a segment: the offsets and headers of its
+// records, with a checksum. The next load takes the records it lists without
+// parsing them or checksumming their payloads, checks only the last one in
+// full and scans on from where the index ends. The index is a cache; one
+// that does not match its segment is ignored.
+
+#define GTFS_WAL_NAME ".wal"
+#define GTFS_WAL_SEGMENT_SIZE (1 << 20)
+#define GTFS_WAL_FREE_SEGMENTS 4   // recycled segments kept for reuse
+#define GTFS_WAL_INDEX_PREFIX "index."
+
+// Records of concurrent committers that share one write() and fdatasync().
+typedef struct wal_batch {
+    std::string buf;
+    std::vector<std::string> files;   // marked pending in the catalog first
+    std::vector<uint64_t> writers;    // of each file's records, 0 if none is known
+    bool done;
+    int result;
+} wal_batch_t;
+
+typedef struct wal {
+    pid_t pid;           // fds belong to this process; a forked child reopens
+    int dfd;             // log directory, carries the flock
+    int fd;              // active segment, -1 if none
+    int dio_fd;          // same segment opened O_DIRECT, -1 if unused or unsupported
+    bool direct;
+    char* stage;         // aligned staging buffer for O_DIRECT writes
+    size_t stage_size;
+    uint64_t seq;
+    ino_t ino;           // detects the segment being recycled under us
+    char* addr;
+    size_t size;
+    size_t tail;
+    bool flushing;
+    std::shared_ptr<wal_batch_t> filling;
+    std::mutex lock;
+    std::condition_variable cv;
+} wal_t;
+
+// All valid records of a log directory, in log order. The records point into
+// the mapped segments until the image is released.
+typedef struct wal_image {
+    std::vector<uint64_t> seqs;
+    std::vector<std::pair<char*, size_t> > maps;
+    std::vector<size_t> ends;    // end of the valid records in each segment
+    std::vector<log_record_t> records;
+    size_t indexed;              // records taken from segment indexes
+} wal_image_t;
+
+std::string gtfs_wal_dir(gtfs_t* gtfs);
+std::vector<uint64_t> gtfs_wal_segments(std::string wal_dir);
+std::string gtfs_wal_segment_name(uint64_t seq);
+// With index set, writes the index of segments that lack a fresh one; only
+// for callers holding the log's flock.
+int gtfs_wal_load(std::string wal_dir, wal_image_t& image, bool index = false);
+void gtfs_wal_release(wal_image_t& image);
+
+// writers, if given, names the file_t writer of each of files' records.
+int gtfs_wal_commit(gtfs_t* gtfs, const std::string& buf, const std::vector<std::string>& files,
+                    const std::vector<uint64_t>& writers = std::vector<uint64_t>());
+int gtfs_wal_replay(gtfs_t* gtfs, std::string filename);
+int gtfs_wal_recover(gtfs_t* gtfs, const std::vector<std::string>& files);
+int gtfs_wal_checkpoint(gtfs_t* gtfs);
+
+#endif
@@ -0,0 +1,143 @@
+#include "gtfs_window.hpp"
+#include "gtfs_trace.hpp"
+#include "gtfs_io.hpp"
+
+#include <sys/mman.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+extern int do_verbose;
+
+static size_t window_length(window_map_t* wm, off_t n) {
+    off_t rest = wm->size - n * GTFS_MAP_WINDOW;
+    return (size_t)(rest < GTFS_MAP_WINDOW ? rest : GTFS_MAP_WINDOW);
+}
+
+static char* window_get(window_map_t* wm, off_t n, int extra_flags) {
+    lock_guard<mutex> guard(wm->lock);
+    map<off_t, char*>::iterator it = wm->windows.find(n);
+    if (it != wm->windows.end()) {
+        return it->second;
+    }
+    void* addr = gtfs_io()->mmap(NULL, window_length(wm, n), wm->prot, wm->flags | extra_flags, wm->fd, n * GTFS_MAP_WINDOW);
+    if (addr == MAP_FAILED) {
+        ERROR_PRINT("cannot map window " << n << "\n");
+        return NULL;
+    }
+    wm->windows[n] = (char*)addr;
+    return (char*)addr;
+}
+
+// A file that fits in one window is mapped and populated right away, as a
+// whole-file mapping would be.
+window_map_t* gtfs_window_map(int fd, off_t size, int prot, int flags) {
+    window_map_t* wm = new window_map_t();
+    wm->fd = fd;
+    wm->size = size;
+    wm->prot = prot;
+    wm->flags = flags;
+    if (size > 0 && size <= GTFS_MAP_WINDOW && window_get(wm, 0, MAP_POPULATE) == NULL) {
+        delete wm;
+        return NULL;
+    }
+    return wm;
+}
+
+void gtfs_window_unmap(window_map_t* wm) {
+    if (wm == NULL) {
+        return;
+    }
+    for (map<off_t, char*>::iterator it = wm->windows.begin(); it != wm->windows.end(); ++it) {
+        gtfs_io()->munmap(it->second, window_length(wm, it->first));
+    }
+    delete wm;
+}
+
+// The address of offset, and in *avail how many bytes follow it in the same
+// window.
+char* gtfs_window_at(window_map_t* wm, off_t offset, size_t* avail) {
+    if (offset < 0 || offset >= wm->size) {
+        return NULL;
+    }
+    off_t n = offset / GTFS_MAP_WINDOW;
+    char* base = window_get(wm, n, 0);
+    if (base == NULL) {
+        return NULL;
+    }
+    size_t within = (size_t)(offset - n * GTFS_MAP_WINDOW);
+    if (avail) {
+        *avail = window_length(wm, n) - within;
+    }
+    return base + within;
+}
+
+int gtfs_window_read(window_map_t* wm, off_t offset, size_t length, char* dst) {
+    if (wm == NULL || offset < 0 || length > (size_t)wm->size || offset > wm->size - (off_t)length) {
+        return -1;
+    }
+    while (length > 0) {
+        size_t avail;
+        char* src = gtfs_window_at(wm, offset, &avail);
+        if (src == NULL) {
+            return -1;
+        }
+        size_t n = length < avail ? length : avail;
+        memcpy(dst, src, n);
+        dst += n;
+        offset += (off_t)n;
+        length -= n;
+    }
+    return 0;
+}
+
+int gtfs_window_write(window_map_t* wm, off_t offset, size_t length, const char* src) {
+    if (wm == NULL || offset < 0 || length > (size_t)wm->size || offset > wm->size - (off_t)length) {
+        return -1;
+    }
+    while (length > 0) {
+        size_t avail;
+        char* dst = gtfs_window_at(wm, offset, &avail);
+        if (dst == NULL) {
+            return -1;
+        }
+        size_t n = length < avail ? length : avail;
+        memcpy(dst, src, n);
+        src += n;
+        offset += (off_t)n;
+        length -= n;
+    }
+    return 0;
+}
+
+int gtfs_window_sync(window_map_t* wm) {
+    int ret = 0;
+    lock_guard<mutex> guard(wm->lock);
+    for (map<off_t, char*>::iterator it = wm->windows.begin(); it != wm->windows.end(); ++it) {
+        if (gtfs_io()->msync(it->second, window_length(wm, it->first), MS_SYNC) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+void gtfs_window_advise(window_map_t* wm, off_t offset, size_t length, int advice) {
+    if (wm == NULL || wm->size <= GTFS_MAP_WINDOW || offset < 0) {
+        return;
+    }
+    static const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    off_t end = offset + (off_t)length < wm->size ? offset + (off_t)length : wm->size;
+    while (offset < end) {
+        size_t avail;
+        char* addr = gtfs_window_at(wm, offset, &avail);
+        if (addr == NULL) {
+            return;
+        }
+        size_t n = (size_t)(end - offset) < avail ? (size_t)(end - offset) : avail;
+        char* base = (char*)((uintptr_t)addr & ~(page - 1));
+        gtfs_io()->madvise(base, n + (size_t)(addr - base), advice);
+        offset += (off_t)n;
+    }
+}
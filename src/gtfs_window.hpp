@@ -0,0 +1,37 @@
+#ifndef GTFS_WINDOW
+#define GTFS_WINDOW
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <map>
+#include <mutex>
+
+// A file mapped in fixed-size windows rather than one contiguous mapping.
+// Windows are mapped the first time a byte in them is touched and stay
+// mapped until the whole map is released, so a multi-terabyte file needs
+// neither a huge stretch of address space nor a commit charge for the parts
+// nobody uses. Small files still get a single populated window.
+
+#define GTFS_MAP_WINDOW ((off_t)1 << 30)
+
+typedef struct window_map {
+    int fd;                // not owned
+    off_t size;
+    int prot;
+    int flags;             // MAP_PRIVATE or MAP_SHARED
+    std::map<off_t, char*> windows;   // window number -> mapping
+    std::mutex lock;       // guards windows, so threads can map concurrently
+} window_map_t;
+
+window_map_t* gtfs_window_map(int fd, off_t size, int prot, int flags);
+void gtfs_window_unmap(window_map_t* wm);
+
+char* gtfs_window_at(window_map_t* wm, off_t offset, size_t* avail);
+int gtfs_window_read(window_map_t* wm, off_t offset, size_t length, char* dst);
+int gtfs_window_write(window_map_t* wm, off_t offset, size_t length, const char* src);
+int gtfs_window_sync(window_map_t* wm);
+// madvise over [offset, offset + length), clipped to the file. Windows mapped
+// populated at open are skipped.
+void gtfs_window_advise(window_map_t* wm, off_t offset, size_t length, int advice);
+
+#endif
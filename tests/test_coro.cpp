@@ -0,0 +1,79 @@
+#include <gtfs.hpp>
+#include <gtfs_coro.hpp>
+#include <constants.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <fstream>
+#include <cstring>
+
+using namespace std;
+
+int verbose {0};
+
+// Writes one slot and commits it; returns the commit's result.
+gtfs_co::task<int> put(gtfs_co::loop& lp, gtfs_t* gtfs, file_t* fl, size_t slot) {
+    string data = "slot" + to_string(slot % 10000);
+    data.resize(8, '.');
+    write_t* wrt = co_await gtfs_co::write(gtfs, fl, (off_t)slot * 8, data.length(), data.c_str());
+    int ret = co_await gtfs_co::commit(lp, wrt);
+    gtfs_release_write(wrt);
+    co_return ret;
+}
+
+gtfs_co::task<void> client(gtfs_co::loop& lp, gtfs_t* gtfs, file_t* fl, size_t slot, atomic<size_t>& ok) {
+    int ret = co_await put(lp, gtfs, fl, slot);
+    char* read = co_await gtfs_co::read(gtfs, fl, (off_t)slot * 8, 4);
+    if (ret == 0 && read != NULL && string(read, 4) == "slot") {
+        ok++;
+    }
+    free(read);
+}
+
+gtfs_co::task<void> clean(gtfs_co::loop& lp, gtfs_t* gtfs, atomic<size_t>& ok) {
+    int ret = co_await gtfs_co::checkpoint(lp, gtfs);
+    if (ret == 0) {
+        ok++;
+    }
+}
+
+void test_coroutines() {
+    /*
+     *  1. a thousand coroutines write and commit on two worker threads
+     *  2. every commit succeeds and is readable
+     *  3. an awaited checkpoint puts all of it in the base file
+     */
+    string dir = TEST_FS_DIR"/coro";
+    mkdir(dir.c_str(), S_IRWXU);
+    string filename = "testcoro1.txt";
+    size_t clients = 1000;
+    gtfs_t *gtfs = gtfs_init(dir, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, (off_t)clients * 8);
+
+    atomic<size_t> ok(0), cleaned(0);
+    {
+        gtfs_co::loop lp(2);
+        for (size_t i = 0; i < clients; i++) {
+            lp.spawn(client(lp, gtfs, fl, i, ok));
+        }
+        lp.run();
+        lp.spawn(clean(lp, gtfs, cleaned));
+        lp.run();
+    }
+
+    ifstream in(dir + "/" + filename, ios::binary);
+    string base((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    bool durable = base.size() >= clients * 8 && base.compare(8 * 999, 7, "slot999") == 0;
+    gtfs_release_file(gtfs, fl);
+    cout << "commits " << ok << " of " << clients << ", checkpointed " << cleaned << ", durable " << durable << "\n";
+    (ok == clients && cleaned == 1 && durable) ? cout << PASS : cout << FAIL;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2)
+      verbose = (int)strtol(argv[1], NULL, 10);
+
+    cout << "================== Coroutine test 1 ==================\n";
+    cout << "Testing the coroutine front-end" << endl;
+    test_coroutines();
+}
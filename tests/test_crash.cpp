@@ -0,0 +1,677 @@
+#include <gtfs.hpp>
+#include <constants.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Crash-consistency harness. The file system calls GTFileSystem makes are
+// interposed (definitions here take precedence over libc's for the statically
+// linked library) and, for files under the workload directory, recorded as a
+// trace while a workload runs. Stores through shared mappings are recorded at
+// msync and munmap as writes of the pages that changed.
+//
+// Crash states are then built from the trace: for every prefix of it, the
+// on-disk state is what had been made durable plus some choice of what had
+// not. The page cache is modelled after an ordered-journaling file system:
+//   - namespace operations (create, rename, link, unlink) reach the disk in
+//     order; any fsync or fdatasync commits all earlier ones, and of the
+//     later ones some prefix survives;
+//   - writes and size changes of a file survive once the file is synced;
+//     unsynced ones are independently lost, kept, or torn at a sector.
+// Each state is written out to a scratch directory and recovered with
+// gtfs_init; every write acknowledged before the crash point must be there,
+// every other one must be all there or not at all, and an aborted write never.
+// States are checked in forked children, in batches, so a crash in recovery
+// fails the batch instead of the harness.
+
+using namespace std;
+
+#define CRASH_SLOTS 16
+#define CRASH_SLOT_SIZE 100
+#define CRASH_LENGTH ((CRASH_SLOTS + 1) * CRASH_SLOT_SIZE)
+#define CRASH_SAMPLES 24         // crash states per trace position
+#define CRASH_BATCH 128          // crash states per child process
+#define CRASH_SECTOR 512
+#define CRASH_PAGE 4096
+#define CRASH_SCRATCH "/dev/shm"  // crash states go here when it exists
+
+int verbose {0};
+
+typedef struct crash_op {
+    enum kind_t { WRITE, TRUNCATE, EXTEND, SYNC, CREATE, RENAME, LINK, UNLINK, ACK } kind;
+    int ino;            // -1: a directory sync
+    off_t offset;       // WRITE; new size for TRUNCATE and EXTEND
+    string data;        // WRITE
+    string path;        // namespace operations
+    string path2;       // RENAME, LINK: the new name
+    int ack;            // ACK: slot whose write was acknowledged
+} crash_op_t;
+
+typedef struct crash_region {
+    char* addr;
+    size_t length;
+    int ino;
+    off_t offset;
+} crash_region_t;
+
+static const char crash_zeros[CRASH_PAGE] = {0};
+static mutex crash_lock;
+static bool crash_tracing = false;
+static string crash_root;
+static vector<crash_op_t> crash_trace;
+static map<int, int> crash_fds;           // fd -> inode, -1 for directories
+static map<string, int> crash_names;      // path -> inode, as the workload sees it
+static vector<string> crash_files;        // inode -> content, as the workload sees it
+static vector<crash_region_t> crash_regions;
+
+#define CRASH_REAL(ret, name, args) \
+    static ret (*real)args = (ret (*)args)dlsym(RTLD_NEXT, name)
+
+static bool crash_tracked(const char* path) {
+    return crash_tracing && path != NULL && strncmp(path, crash_root.c_str(), crash_root.size()) == 0;
+}
+
+static void crash_apply(string& content, const crash_op_t& op, size_t len) {
+    if (op.kind == crash_op_t::WRITE) {
+        size_t end = (size_t)op.offset + len;
+        if (content.size() < end) {
+            content.resize(end, '\0');
+        }
+        content.replace((size_t)op.offset, len, op.data, 0, len);
+    } else if (op.kind == crash_op_t::TRUNCATE) {
+        content.resize((size_t)op.offset, '\0');
+    } else if (op.kind == crash_op_t::EXTEND && content.size() < (size_t)op.offset) {
+        content.resize((size_t)op.offset, '\0');
+    }
+}
+
+// Records op and applies it to the workload's view. Caller holds crash_lock.
+static void crash_record(const crash_op_t& op) {
+    if (op.kind == crash_op_t::WRITE || op.kind == crash_op_t::TRUNCATE || op.kind == crash_op_t::EXTEND) {
+        crash_apply(crash_files[(size_t)op.ino], op, op.data.size());
+    }
+    crash_trace.push_back(op);
+}
+
+static crash_op_t crash_data_op(crash_op_t::kind_t kind, int ino, off_t offset) {
+    crash_op_t op;
+    op.kind = kind;
+    op.ino = ino;
+    op.offset = offset;
+    op.ack = -1;
+    return op;
+}
+
+static crash_op_t crash_name_op(crash_op_t::kind_t kind, const string& path, const string& path2, int ino) {
+    crash_op_t op = crash_data_op(kind, ino, 0);
+    op.path = path;
+    op.path2 = path2;
+    return op;
+}
+
+// Records the pages of a shared mapping that differ from what the file is
+// known to hold. Caller holds crash_lock.
+static void crash_diff_region(const crash_region_t& r, char* from, char* to) {
+    string& content = crash_files[(size_t)r.ino];
+    char* lo = max(from, r.addr);
+    char* hi = min(to, r.addr + r.length);
+    size_t file_end = content.size() > (size_t)r.offset ? content.size() - (size_t)r.offset : 0;
+    hi = min(hi, r.addr + file_end);
+    for (char* page = lo; page < hi; page += CRASH_PAGE) {
+        size_t len = min((size_t)(hi - page), (size_t)CRASH_PAGE);
+        size_t pos = (size_t)r.offset + (size_t)(page - r.addr);
+        if (memcmp(page, content.data() + pos, len) != 0) {
+            crash_op_t op = crash_data_op(crash_op_t::WRITE, r.ino, (off_t)pos);
+            op.data.assign(page, len);
+            crash_record(op);
+        }
+    }
+}
+
+extern "C" {
+
+int open(const char* path, int flags, ...) {
+    CRASH_REAL(int, "open", (const char*, int, ...));
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = (mode_t)va_arg(ap, int);
+        va_end(ap);
+    }
+    int fd = real(path, flags, mode);
+    if (fd < 0 || !crash_tracked(path)) {
+        return fd;
+    }
+    lock_guard<mutex> guard(crash_lock);
+    struct stat s;
+    if (fstat(fd, &s) == 0 && S_ISDIR(s.st_mode)) {
+        crash_fds[fd] = -1;
+        return fd;
+    }
+    map<string, int>::iterator it = crash_names.find(path);
+    int ino;
+    if (it == crash_names.end()) {
+        ino = (int)crash_files.size();
+        crash_files.push_back(string());
+        crash_names[path] = ino;
+        crash_record(crash_name_op(crash_op_t::CREATE, path, "", ino));
+    } else {
+        ino = it->second;
+        if (flags & O_TRUNC) {
+            crash_record(crash_data_op(crash_op_t::TRUNCATE, ino, 0));
+        }
+    }
+    crash_fds[fd] = ino;
+    return fd;
+}
+
+int close(int fd) {
+    CRASH_REAL(int, "close", (int));
+    {
+        lock_guard<mutex> guard(crash_lock);
+        crash_fds.erase(fd);
+    }
+    return real(fd);
+}
+
+static int crash_fd_ino(int fd) {
+    map<int, int>::iterator it = crash_fds.find(fd);
+    return it == crash_fds.end() ? -2 : it->second;
+}
+
+ssize_t pwrite(int fd, const void* buf, size_t len, off_t offset) {
+    CRASH_REAL(ssize_t, "pwrite", (int, const void*, size_t, off_t));
+    ssize_t n = real(fd, buf, len, offset);
+    lock_guard<mutex> guard(crash_lock);
+    int ino = crash_fd_ino(fd);
+    if (n > 0 && ino >= 0) {
+        crash_op_t op = crash_data_op(crash_op_t::WRITE, ino, offset);
+        op.data.assign((const char*)buf, (size_t)n);
+        crash_record(op);
+    }
+    return n;
+}
+
+ssize_t write(int fd, const void* buf, size_t len) {
+    CRASH_REAL(ssize_t, "write", (int, const void*, size_t));
+    off_t offset = -1;
+    {
+        lock_guard<mutex> guard(crash_lock);
+        if (crash_fd_ino(fd) >= 0) {
+            offset = lseek(fd, 0, SEEK_CUR);
+        }
+    }
+    ssize_t n = real(fd, buf, len);
+    if (n > 0 && offset >= 0) {
+        lock_guard<mutex> guard(crash_lock);
+        int ino = crash_fd_ino(fd);
+        if (ino >= 0) {
+            crash_op_t op = crash_data_op(crash_op_t::WRITE, ino, offset);
+            op.data.assign((const char*)buf, (size_t)n);
+            crash_record(op);
+        }
+    }
+    return n;
+}
+
+int ftruncate(int fd, off_t length) {
+    CRASH_REAL(int, "ftruncate", (int, off_t));
+    int ret = real(fd, length);
+    lock_guard<mutex> guard(crash_lock);
+    int ino = crash_fd_ino(fd);
+    if (ret == 0 && ino >= 0) {
+        crash_record(crash_data_op(crash_op_t::TRUNCATE, ino, length));
+    }
+    return ret;
+}
+
+int fallocate(int fd, int mode, off_t offset, off_t len) {
+    CRASH_REAL(int, "fallocate", (int, int, off_t, off_t));
+    int ret = real(fd, mode, offset, len);
+    lock_guard<mutex> guard(crash_lock);
+    int ino = crash_fd_ino(fd);
+    if (ret == 0 && ino >= 0 && !(mode & FALLOC_FL_KEEP_SIZE)) {
+        crash_record(crash_data_op(crash_op_t::EXTEND, ino, offset + len));
+    }
+    return ret;
+}
+
+static int crash_sync(int fd, int ret) {
+    lock_guard<mutex> guard(crash_lock);
+    int ino = crash_fd_ino(fd);
+    if (ret == 0 && ino >= -1) {
+        crash_record(crash_data_op(crash_op_t::SYNC, ino, 0));
+    }
+    return ret;
+}
+
+int fsync(int fd) {
+    CRASH_REAL(int, "fsync", (int));
+    return crash_sync(fd, real(fd));
+}
+
+int fdatasync(int fd) {
+    CRASH_REAL(int, "fdatasync", (int));
+    return crash_sync(fd, real(fd));
+}
+
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    CRASH_REAL(void*, "mmap", (void*, size_t, int, int, int, off_t));
+    void* p = real(addr, length, prot, flags, fd, offset);
+    lock_guard<mutex> guard(crash_lock);
+    int ino = crash_fd_ino(fd);
+    if (p != MAP_FAILED && ino >= 0 && (flags & MAP_SHARED) && (prot & PROT_WRITE)) {
+        crash_region_t r = {(char*)p, length, ino, offset};
+        crash_regions.push_back(r);
+    }
+    return p;
+}
+
+int msync(void* addr, size_t length, int flags) {
+    CRASH_REAL(int, "msync", (void*, size_t, int));
+    lock_guard<mutex> guard(crash_lock);
+    int ret = real(addr, length, flags);
+    for (size_t i = 0; ret == 0 && i < crash_regions.size(); i++) {
+        crash_region_t& r = crash_regions[i];
+        if ((char*)addr < r.addr + r.length && (char*)addr + length > r.addr) {
+            crash_diff_region(r, (char*)addr, (char*)addr + length);
+            if (flags & MS_SYNC) {
+                crash_record(crash_data_op(crash_op_t::SYNC, r.ino, 0));
+            }
+        }
+    }
+    return ret;
+}
+
+int munmap(void* addr, size_t length) {
+    CRASH_REAL(int, "munmap", (void*, size_t));
+    {
+        lock_guard<mutex> guard(crash_lock);
+        for (size_t i = 0; i < crash_regions.size(); ) {
+            crash_region_t& r = crash_regions[i];
+            if (r.addr >= (char*)addr && r.addr + r.length <= (char*)addr + length) {
+                crash_diff_region(r, r.addr, r.addr + r.length);
+                crash_regions.erase(crash_regions.begin() + (long)i);
+            } else {
+                i++;
+            }
+        }
+    }
+    return real(addr, length);
+}
+
+int rename(const char* from, const char* to) {
+    CRASH_REAL(int, "rename", (const char*, const char*));
+    int ret = real(from, to);
+    if (ret == 0 && crash_tracked(from)) {
+        lock_guard<mutex> guard(crash_lock);
+        map<string, int>::iterator it = crash_names.find(from);
+        if (it != crash_names.end()) {
+            int ino = it->second;
+            crash_names.erase(it);
+            crash_names[to] = ino;
+            crash_record(crash_name_op(crash_op_t::RENAME, from, to, ino));
+        }
+    }
+    return ret;
+}
+
+int link(const char* from, const char* to) {
+    CRASH_REAL(int, "link", (const char*, const char*));
+    int ret = real(from, to);
+    if (ret == 0 && crash_tracked(from)) {
+        lock_guard<mutex> guard(crash_lock);
+        map<string, int>::iterator it = crash_names.find(from);
+        if (it != crash_names.end()) {
+            crash_names[to] = it->second;
+            crash_record(crash_name_op(crash_op_t::LINK, from, to, it->second));
+        }
+    }
+    return ret;
+}
+
+static void crash_unlinked(const char* path) {
+    lock_guard<mutex> guard(crash_lock);
+    map<string, int>::iterator it = crash_names.find(path);
+    if (it != crash_names.end()) {
+        crash_record(crash_name_op(crash_op_t::UNLINK, path, "", it->second));
+        crash_names.erase(it);
+    }
+}
+
+int unlink(const char* path) {
+    CRASH_REAL(int, "unlink", (const char*));
+    int ret = real(path);
+    if (ret == 0 && crash_tracked(path)) {
+        crash_unlinked(path);
+    }
+    return ret;
+}
+
+int remove(const char* path) {
+    CRASH_REAL(int, "remove", (const char*));
+    int ret = real(path);
+    if (ret == 0 && crash_tracked(path)) {
+        crash_unlinked(path);
+    }
+    return ret;
+}
+
+} // extern "C"
+
+static void crash_ack(int slot) {
+    lock_guard<mutex> guard(crash_lock);
+    crash_op_t op = crash_data_op(crash_op_t::ACK, -1, 0);
+    op.ack = slot;
+    crash_trace.push_back(op);
+}
+
+/* Crash states */
+
+static bool crash_is_name_op(const crash_op_t& op) {
+    return op.kind == crash_op_t::CREATE || op.kind == crash_op_t::RENAME ||
+           op.kind == crash_op_t::LINK || op.kind == crash_op_t::UNLINK;
+}
+
+// The disk after a crash just before trace[point]. seed 0 keeps nothing that
+// was not durable, seed 1 keeps everything, others choose at random.
+static void crash_build(size_t point, unsigned seed, map<string, int>& names, vector<string>& files) {
+    uint64_t rng = seed * 0x9E3779B97F4A7C15ull + point;
+    auto next = [&rng](uint64_t n) {
+        rng = rng * 6364136223846793005ull + 1442695040888963407ull;
+        return n == 0 ? 0 : (rng >> 33) % n;
+    };
+    size_t barrier = 0;
+    vector<size_t> synced(crash_files.size(), 0);
+    size_t pending_names = 0;
+    for (size_t i = 0; i < point; i++) {
+        const crash_op_t& op = crash_trace[i];
+        if (op.kind == crash_op_t::SYNC) {
+            barrier = i + 1;
+            if (op.ino >= 0) {
+                synced[(size_t)op.ino] = i + 1;
+            }
+        }
+    }
+    for (size_t i = barrier; i < point; i++) {
+        if (crash_is_name_op(crash_trace[i])) {
+            pending_names++;
+        }
+    }
+    size_t keep_names = seed == 0 ? 0 : seed == 1 ? pending_names : (size_t)next(pending_names + 1);
+
+    names.clear();
+    files.assign(crash_files.size(), string());
+    size_t seen_names = 0;
+    for (size_t i = 0; i < point; i++) {
+        const crash_op_t& op = crash_trace[i];
+        if (crash_is_name_op(op)) {
+            if (i >= barrier && seen_names++ >= keep_names) {
+                continue;
+            }
+            if (op.kind == crash_op_t::CREATE) {
+                names[op.path] = op.ino;
+            } else if (op.kind == crash_op_t::RENAME) {
+                names.erase(op.path);
+                names[op.path2] = op.ino;
+            } else if (op.kind == crash_op_t::LINK) {
+                names[op.path2] = op.ino;
+            } else {
+                names.erase(op.path);
+            }
+        } else if (op.kind == crash_op_t::WRITE || op.kind == crash_op_t::TRUNCATE || op.kind == crash_op_t::EXTEND) {
+            size_t len = op.data.size();
+            if (i >= synced[(size_t)op.ino]) {
+                uint64_t fate = seed == 0 ? 0 : seed == 1 ? 1 : next(3);
+                if (fate == 0) {
+                    continue;
+                }
+                if (fate == 2 && op.kind == crash_op_t::WRITE) {
+                    // Torn at a sector boundary inside the write, if it spans one.
+                    size_t first = ((size_t)op.offset / CRASH_SECTOR + 1) * CRASH_SECTOR - (size_t)op.offset;
+                    if (first < len) {
+                        size_t cuts = (len - first + CRASH_SECTOR - 1) / CRASH_SECTOR;
+                        len = first + (size_t)next(cuts) * CRASH_SECTOR;
+                    }
+                }
+            }
+            crash_apply(files[(size_t)op.ino], op, len);
+        }
+    }
+}
+
+static void crash_remove_dir(const string& dir) {
+    DIR* d = opendir(dir.c_str());
+    if (d == NULL) {
+        return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        string name = ent->d_name;
+        if (name != "." && name != ".." && unlink((dir + "/" + name).c_str()) != 0 && errno == EISDIR) {
+            crash_remove_dir(dir + "/" + name);
+        }
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+// Writes a crash state out under scratch; zero pages stay holes.
+static void crash_materialize(const string& scratch, const map<string, int>& names, const vector<string>& files) {
+    crash_remove_dir(scratch);
+    mkdir(scratch.c_str(), S_IRWXU);
+    for (map<string, int>::const_iterator it = names.begin(); it != names.end(); it++) {
+        string rel = "/" + it->first.substr(crash_root.size());
+        for (size_t slash = rel.find('/', 1); slash != string::npos; slash = rel.find('/', slash + 1)) {
+            mkdir((scratch + rel.substr(0, slash)).c_str(), S_IRWXU);
+        }
+        const string& content = files[(size_t)it->second];
+        int fd = open((scratch + rel).c_str(), O_CREAT|O_TRUNC|O_WRONLY, S_IRWXU);
+        if (fd < 0) {
+            continue;
+        }
+        if (ftruncate(fd, (off_t)content.size()) != 0) {
+            close(fd);
+            continue;
+        }
+        for (size_t pos = 0; pos < content.size(); pos += CRASH_PAGE) {
+            size_t len = min(content.size() - pos, (size_t)CRASH_PAGE);
+            if (memcmp(content.data() + pos, crash_zeros, len) != 0 && pwrite(fd, content.data() + pos, len, (off_t)pos) < 0) {
+                break;
+            }
+        }
+        close(fd);
+    }
+}
+
+static string crash_slot_data(int slot) {
+    string data = "slot " + to_string(slot) + " ";
+    while (data.size() < CRASH_SLOT_SIZE) {
+        data += (char)('a' + (data.size() + (size_t)slot) % 26);
+    }
+    return data;
+}
+
+// Recovers one crash state and checks it; returns an empty string if it holds.
+static string crash_check(const string& scratch, const string& filename, size_t point) {
+    vector<bool> acked(CRASH_SLOTS, false);
+    for (size_t i = 0; i < point; i++) {
+        if (crash_trace[i].kind == crash_op_t::ACK) {
+            acked[(size_t)crash_trace[i].ack] = true;
+        }
+    }
+    gtfs_t* gtfs = gtfs_init(scratch, 0);
+    if (gtfs == NULL) {
+        return "gtfs_init failed";
+    }
+    file_t* fl = gtfs_open_file(gtfs, filename, CRASH_LENGTH);
+    if (fl == NULL) {
+        return "open failed";
+    }
+    char* data = gtfs_read_file(gtfs, fl, 0, CRASH_LENGTH);
+    string problem;
+    if (data == NULL) {
+        problem = "read failed";
+    }
+    string zeros(CRASH_SLOT_SIZE, '\0');
+    for (int i = 0; problem.empty() && i <= CRASH_SLOTS; i++) {
+        string got(data + i * CRASH_SLOT_SIZE, CRASH_SLOT_SIZE);
+        if (i == CRASH_SLOTS) {
+            if (got != zeros) {
+                problem = "aborted write visible";
+            }
+        } else if (got != crash_slot_data(i) && (acked[(size_t)i] || got != zeros)) {
+            problem = "slot " + to_string(i) + (acked[(size_t)i] ? " lost" : " torn");
+        }
+    }
+    free(data);
+    gtfs_release_file(gtfs, fl);
+    return problem;
+}
+
+// Checks states [first, last) of the (point, seed) grid; returns the failures.
+static int crash_run_batch(const string& scratch, const string& filename, size_t first, size_t last) {
+    int failures = 0;
+    map<string, int> names;
+    vector<string> files;
+    for (size_t s = first; s < last; s++) {
+        size_t point = s / CRASH_SAMPLES;
+        unsigned seed = (unsigned)(s % CRASH_SAMPLES);
+        if (point < crash_trace.size() && crash_trace[point].kind == crash_op_t::ACK) {
+            continue;   // same disk as the next position, which expects more
+        }
+        crash_build(point, seed, names, files);
+        crash_materialize(scratch, names, files);
+        string problem = crash_check(scratch, filename, point);
+        if (!problem.empty()) {
+            if (failures++ < 3) {
+                const crash_op_t& op = crash_trace[point < crash_trace.size() ? point : crash_trace.size() - 1];
+                static const char* kinds[] = {"write", "truncate", "extend", "sync", "create", "rename", "link", "unlink", "ack"};
+                cout << "crash before op " << point << " (" << kinds[op.kind] << " " << op.path << ") seed " << seed
+                     << ": " << problem << "\n" << flush;
+            }
+        }
+    }
+    crash_remove_dir(scratch);
+    return failures;
+}
+
+void test_crash_states() {
+    /*
+     *  1. a workload of synced writes, an aborted write and checkpoints is
+     *     traced
+     *  2. every crash state of the trace recovers, keeps every acknowledged
+     *     write, has no torn write and no aborted one
+     */
+    string base = TEST_FS_DIR"/crash";
+    crash_remove_dir(base);
+    mkdir(base.c_str(), S_IRWXU);
+    string dir = base + "/live";
+    mkdir(dir.c_str(), S_IRWXU);
+    string filename = "testcrash1.txt";
+
+    crash_root = dir + "/";
+    crash_tracing = true;
+    gtfs_t *gtfs = gtfs_init(dir, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, CRASH_LENGTH);
+    for (int i = 0; i < CRASH_SLOTS; i++) {
+        if (i == CRASH_SLOTS / 2) {
+            string junk(CRASH_SLOT_SIZE, 'X');
+            write_t *aborted = gtfs_write_file(gtfs, fl, CRASH_SLOTS * CRASH_SLOT_SIZE, junk.size(), junk.c_str());
+            gtfs_abort_write_file(aborted);
+            gtfs_release_write(aborted);
+            gtfs_clean(gtfs);
+        }
+        string data = crash_slot_data(i);
+        write_t *wrt = gtfs_write_file(gtfs, fl, i * CRASH_SLOT_SIZE, data.size(), data.c_str());
+        if (gtfs_sync_write_file(wrt) == 0) {
+            crash_ack(i);
+        }
+        gtfs_release_write(wrt);
+    }
+    gtfs_close_file(gtfs, fl);
+    gtfs_release_file(gtfs, fl);
+    gtfs_clean(gtfs);
+    {
+        lock_guard<mutex> guard(crash_lock);
+        crash_tracing = false;
+    }
+
+    // Recovery syncs for real; on tmpfs that costs nothing.
+    struct stat shm;
+    string scratch = stat(CRASH_SCRATCH, &shm) == 0 && S_ISDIR(shm.st_mode) ?
+                     string(CRASH_SCRATCH "/gtfs_crash.") + to_string(getpid()) : base + "/state";
+    size_t states = (crash_trace.size() + 1) * CRASH_SAMPLES;
+    size_t checked = CRASH_SAMPLES;
+    for (size_t i = 0; i < crash_trace.size(); i++) {
+        if (crash_trace[i].kind != crash_op_t::ACK) {
+            checked += CRASH_SAMPLES;
+        }
+    }
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t parallel = nprocs < 1 ? 1 : (size_t)nprocs;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int failures = 0;
+    map<pid_t, size_t> running;
+    cout << flush;
+    for (size_t first = 0; first < states || !running.empty(); ) {
+        if (first < states && running.size() < parallel) {
+            size_t last = min(first + CRASH_BATCH, states);
+            pid_t pid = fork();
+            if (pid == 0) {
+                int f = crash_run_batch(scratch + to_string(first), filename, first, last);
+                _exit(f > 255 ? 255 : f);
+            }
+            if (pid < 0) {
+                failures++;
+                break;
+            }
+            running[pid] = first;
+            first = last;
+            continue;
+        }
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            break;
+        }
+        if (!WIFEXITED(status)) {
+            cout << "recovery crashed in the batch from state " << running[pid] << "\n";
+            failures++;
+        } else {
+            failures += WEXITSTATUS(status);
+        }
+        running.erase(pid);
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << checked << " crash states of " << crash_trace.size() << " operations in " << (int)(secs * 1000)
+         << " ms (" << (int)((double)checked / secs) << " per second), " << failures << " failed\n";
+    failures == 0 ? cout << PASS : cout << FAIL;
+    crash_remove_dir(base);
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2)
+      verbose = (int)strtol(argv[1], NULL, 10);
+
+    cout << "================== Crash test 1 ==================\n";
+    cout << "Testing recovery from simulated power loss" << endl;
+    test_crash_states();
+}
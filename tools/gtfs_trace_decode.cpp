@@ -0,0 +1,59 @@
+#include <gtfs_trace.hpp>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+// Converts a binary GTFS trace into Chrome trace event JSON, which can be
+// loaded in chrome://tracing or ui.perfetto.dev.
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: ./gtfs_trace_decode trace_file [output.json]\n");
+        return 1;
+    }
+
+    ifstream ifs(argv[1], ios::binary);
+    trace_header_t hdr;
+    if (!ifs.read((char*)&hdr, sizeof(hdr)) || memcmp(hdr.magic, GTFS_TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+        cout << "Not a GTFS trace file: " << argv[1] << endl;
+        return 1;
+    }
+    if (hdr.event_size != sizeof(trace_event_t)) {
+        cout << "Unsupported trace event size " << hdr.event_size << endl;
+        return 1;
+    }
+
+    ofstream ofs;
+    if (argc > 2) {
+        ofs.open(argv[2]);
+    }
+    ostream& out = argc > 2 ? ofs : cout;
+
+    out << "{\"traceEvents\":[\n";
+    trace_event_t ev;
+    bool first = true;
+    size_t count = 0;
+    while (ifs.read((char*)&ev, sizeof(ev))) {
+        if (!first) {
+            out << ",\n";
+        }
+        first = false;
+        out << "{\"name\":\"" << gtfs_trace_event_name(ev.id) << "\""
+            << ",\"ph\":\"" << (char)ev.phase << "\""
+            << ",\"ts\":" << ev.ts_ns / 1000 << "." << (ev.ts_ns % 1000) / 100
+            << ",\"pid\":" << hdr.pid
+            << ",\"tid\":" << ev.tid;
+        if (ev.phase == GTFS_PH_BEGIN || ev.phase == GTFS_PH_INSTANT) {
+            out << ",\"args\":{\"arg\":" << ev.arg << "}";
+        }
+        out << "}";
+        count++;
+    }
+    out << "\n]}\n";
+
+    cerr << count << " events decoded" << endl;
+    return 0;
+}